@@ -0,0 +1,21 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+#include <Windows.h>
+
+// Creates a central switch to run the benchmarks after the system is initialized and before the tests start
+#define RUN_BENCHMARKS                           0
+
+#define BENCHMARK_DURATION_MS                    ((ULONG64) 2000)
+#define MAX_BENCHMARK_THREADS                    16
+
+// How many slots each disc slot benchmark thread allocates at once before freeing them one by one
+// This mirrors the modified writer allocating a batch and faults freeing slots individually
+#define DISC_SLOT_BENCHMARK_BATCH                ((ULONG64) 16)
+
+// How many pages each decommit benchmark thread faults in and decommits at once
+// It is kept well under a PTE region, so every region is shared by several threads' chunks
+#define DECOMMIT_BENCHMARK_CHUNK                 ((ULONG64) 64)
+
+extern VOID run_benchmarks(VOID);
+
+#endif //BENCHMARKS_H
@@ -0,0 +1,60 @@
+#ifndef COMPRESSED_CACHE_H
+#define COMPRESSED_CACHE_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+
+// Creates a central switch to turn the compressed page cache on/off
+// When it is on, the modified writer compresses pages into memory before it considers the paging file
+#define COMPRESSED_CACHE                         1
+
+// This is the cache's own budget, separate from our physical page pool
+#define COMPRESSED_CACHE_SIZE_IN_MB              ((ULONG64) 64)
+#define COMPRESSED_CACHE_SIZE_IN_BYTES           MB(COMPRESSED_CACHE_SIZE_IN_MB)
+
+// Compressed blocks come out of the arena in size classes that are multiples of this granule
+#define COMPRESSED_BLOCK_GRANULE                 ((ULONG64) 256)
+// A page that does not compress to at least this size is not worth keeping and goes straight to the paging file
+#define MAX_COMPRESSED_PAGE_SIZE                 ((ULONG64) 3072)
+#define NUMBER_OF_SIZE_CLASSES                   (MAX_COMPRESSED_PAGE_SIZE / COMPRESSED_BLOCK_GRANULE)
+#define MAX_COMPRESSED_ENTRIES                   (COMPRESSED_CACHE_SIZE_IN_BYTES / COMPRESSED_BLOCK_GRANULE)
+
+// How many of the oldest entries get written back to the paging file when the cache is full
+#define COMPRESSED_WRITEBACK_BATCH               ((ULONG64) 16)
+
+// Disc indices with this bit set name an entry in the compressed cache instead of a slot on the paging file
+// The disc index field of a PTE is 40 bits wide, which is far more than the paging file needs
+#define COMPRESSED_INDEX_BIT                     ((ULONG64) 1 << 39)
+#define IS_COMPRESSED_INDEX(x)                   ((x) != DISC_INDEX_FAIL_CODE && ((x) & COMPRESSED_INDEX_BIT) != 0)
+
+typedef struct {
+    // Position on the LRU list, only linked once the owner of the page has been pointed at this entry
+    LIST_ENTRY entry;
+    // The PTE of the page, this is what gets updated if the entry is written back to the paging file
+    PPTE pte;
+    PUCHAR block;
+    USHORT compressed_size;
+    UCHAR size_class;
+    UCHAR on_lru;
+} COMPRESSED_ENTRY, *PCOMPRESSED_ENTRY;
+
+extern CRITICAL_SECTION compressed_cache_lock;
+extern PUCHAR compressed_arena;
+extern ULONG64 compressed_arena_used;
+extern PVOID compressed_block_free_lists[NUMBER_OF_SIZE_CLASSES];
+extern PCOMPRESSED_ENTRY compressed_entries;
+extern LIST_ENTRY compressed_entry_free_list;
+extern LIST_ENTRY compressed_lru;
+extern volatile ULONG64 compressed_pages_stored;
+extern volatile ULONG64 compressed_pages_rejected;
+extern volatile ULONG64 compressed_pages_loaded;
+extern volatile ULONG64 compressed_pages_written_back;
+
+extern ULONG64 store_compressed_page(PVOID page_va, PPTE pte);
+extern VOID publish_compressed_page(ULONG64 compressed_index);
+extern VOID load_compressed_page(ULONG64 compressed_index, PVOID dst_va);
+extern VOID free_compressed_page(ULONG64 compressed_index);
+extern VOID write_back_compressed_pages(ULONG64 num_pages);
+extern VOID print_compressed_cache_stats(VOID);
+
+#endif //COMPRESSED_CACHE_H
@@ -62,11 +62,37 @@ extern READWRITE_LOG_ENTRY page_log[LOG_SIZE];
 extern LONG64 readwrite_log_index;
 #endif
 
+// Fault latencies are kept in HDR style histograms, each power of two range of nanoseconds is split into linear sub buckets
+// So a latency is never more than 1/16th away from the bucket it lands in, no matter how large it is
+#define FAULT_LATENCY_SUB_BUCKET_BITS            4
+#define FAULT_LATENCY_SUB_BUCKETS                ((ULONG64) 1 << FAULT_LATENCY_SUB_BUCKET_BITS)
+#define FAULT_LATENCY_BUCKETS                    ((64 - FAULT_LATENCY_SUB_BUCKET_BITS + 1) * FAULT_LATENCY_SUB_BUCKETS)
+
+// The kinds of fault each thread times separately, time spent waiting for a page is also counted in the fault it was for
+#define DEMAND_ZERO_FAULT                        0
+#define SOFT_FAULT                               1
+#define HARD_FAULT                               2
+#define FAKE_FAULT                               3
+#define PAGE_WAIT                                4
+// Just the page file read of a hard fault, this is how the mapped and direct I/O page file modes are compared
+#define HARD_FAULT_READ                          5
+#define NUMBER_OF_FAULT_LATENCIES                6
+
 typedef struct {
+    ULONG64 count;
+    ULONG64 total;
+    ULONG64 max;
+    ULONG64 buckets[FAULT_LATENCY_BUCKETS];
+} HDR_HISTOGRAM, *PHDR_HISTOGRAM;
+
+// Each faulting thread owns one of these, so it updates them without any interlocked operations
+// They are aligned to a cache line so that neighbouring threads' counters never share one
+typedef struct DECLSPEC_ALIGN(64) {
     ULONG64 num_first_accesses;
     ULONG64 num_reaccesses;
     ULONG64 num_faults;
     ULONG64 num_fake_faults;
+    HDR_HISTOGRAM latencies[NUMBER_OF_FAULT_LATENCIES];
 } FAULT_STATS, *PFAULT_STATS;
 
 extern PFAULT_STATS fault_stats;
@@ -74,5 +100,8 @@ extern PFAULT_STATS fault_stats;
 extern VOID check_list_integrity(PPFN_LIST listhead, PPFN match_pfn);
 extern VOID log_access(ULONG is_pte, PVOID ppte_or_fn, ULONG operation);
 extern VOID print_va_access_rate(VOID);
+extern VOID record_fault_latency(PFAULT_STATS stats, ULONG type, ULONG64 start_time);
+extern VOID merge_fault_latencies(PHDR_HISTOGRAM merged);
+extern VOID print_fault_latencies(VOID);
 
 #endif //VM_DEBUG_H
@@ -0,0 +1,35 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pagefile.h"
+
+// Creates a central switch to turn deduplication of paging file slots on/off
+// When it is on, a page identical to one already on the paging file shares that page's slot instead of being written
+#define PAGEFILE_DEDUP                           1
+
+// The slot index table is direct mapped, a newer page simply replaces whatever was in its bucket
+#define DEDUP_TABLE_BITS                         16
+#define DEDUP_TABLE_SIZE                         ((ULONG64) 1 << DEDUP_TABLE_BITS)
+
+// Each table entry holds the slot plus one in its low bits, so that zero means empty
+// The rest of the entry holds the top bits of the page's hash, which rules out most false matches without a read
+#define DEDUP_SLOT_BITS                          40
+#define DEDUP_SLOT_MASK                          (((ULONG64) 1 << DEDUP_SLOT_BITS) - 1)
+#define DEDUP_EMPTY_ENTRY                        ((ULONG64) 0)
+
+extern volatile ULONG64 *dedup_table;
+// How many owners each paging file slot has, a slot only goes back to the bitmap when this reaches zero
+extern volatile LONG *slot_reference_counts;
+// The bucket each slot was entered into, so that freeing a slot can take it out of the table
+extern PULONG slot_buckets;
+
+extern volatile ULONG64 dedup_hits;
+
+extern ULONG64 hash_page(PVOID page_va);
+extern ULONG64 find_duplicate_slot(PVOID page_va, ULONG64 hash);
+extern VOID insert_dedup_slot(ULONG64 disc_index, ULONG64 hash);
+extern VOID set_slot_reference(ULONG64 disc_index);
+extern BOOLEAN release_slot_reference(ULONG64 disc_index);
+
+#endif //DEDUP_H
@@ -30,7 +30,10 @@
 #define NUMBER_OF_DISC_PAGES                     (NUMBER_OF_USER_DISC_PAGES + NUMBER_OF_SYSTEM_DISC_PAGES)
 
 #define NUMBER_OF_FAULTING_THREADS               2
-#define NUMBER_OF_SYSTEM_THREADS                 3
+// The scheduler decides how many of the modified writers are running at any time
+#define NUMBER_OF_MODIFIED_WRITERS               4
+// The trimmer and the scheduler, plus every modified writer
+#define NUMBER_OF_SYSTEM_THREADS                 (2 + NUMBER_OF_MODIFIED_WRITERS)
 
 #endif //HARDWARE_H
 
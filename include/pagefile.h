@@ -7,8 +7,20 @@
 #define PAGE_FILE_SIZE_IN_BYTES                  (NUMBER_OF_DISC_PAGES * PAGE_SIZE)
 #define PAGE_FILE_SIZE_IN_BITS                   (PAGE_FILE_SIZE_IN_BYTES * BITS_PER_BYTE)
 
+// This is the page file used when none are given on the command line
 #define PAGEFILE_ABSOLUTE_PATH "C:\\Users\\ltm14\\CLionProjects\\vm\\pagefile\\pagefile.sys"
 
+// Page files are given with --pagefile path[,weight], usually one per drive
+// Each one owns its own partition of the disc indices, so the file a slot is on is its index / PAGES_PER_PAGEFILE
+#define MAX_PAGEFILES                            ((ULONG64) 4)
+#define PAGES_PER_PAGEFILE                       NUMBER_OF_DISC_PAGES
+#define PAGEFILE_FROM_DISC_INDEX(x)              ((x) / PAGES_PER_PAGEFILE)
+#define OFFSET_IN_PAGEFILE(x)                    ((x) % PAGES_PER_PAGEFILE)
+#define MAX_PAGEFILE_WEIGHT                      ((ULONG64) 16)
+
+// The modified writer spreads each batch across the page files this many slots at a time
+#define PAGEFILE_STRIPE_SIZE                     ((ULONG64) 64)
+
 #define BITMAP_CHUNK                             ULONG64
 #define PBITMAP_CHUNK                            PULONG64
 #define BITMAP_CHUNK_SIZE                        ((ULONG64) sizeof(ULONG64))
@@ -20,37 +32,143 @@
 #define EMPTY_UNIT                               ((ULONG64) 0)
 #define FULL_UNIT                                ((ULONG64) 1)
 
-#define BITMAP_SIZE_IN_BITS                      NUMBER_OF_DISC_PAGES
+#define BITMAP_SIZE_IN_BITS                      (MAX_PAGEFILES * PAGES_PER_PAGEFILE)
 #define BITMAP_SIZE_IN_BYTES                     (BITMAP_SIZE_IN_BITS / BITS_PER_BYTE)
 #define BITMAP_SIZE_IN_PAGES                     max( ((ULONG64) 1), (BITMAP_SIZE_IN_BYTES / PAGE_SIZE))
 #define BITMAP_SIZE_IN_CHUNKS                    (BITMAP_SIZE_IN_BYTES / BITMAP_CHUNK_SIZE)
 
-#define BITMAP_REGION_SIZE_IN_BYTES              ((ULONG64) 4096)
-#define BITMAP_REGION_SIZE_IN_BITS               (BITMAP_REGION_SIZE_IN_BYTES * BITS_PER_BYTE)
+#define DISC_INDEX_FAIL_CODE                     0xFFFFFFFFFFFFFFFF
 
-#define BITMAP_SIZE_IN_REGIONS                   (BITMAP_SIZE_IN_BYTES / BITMAP_REGION_SIZE_IN_BYTES)
+// The summaries have one level one bit per bitmap chunk, and one level two bit per level one chunk
+// So finding a chunk costs a scan over the level two chunks plus two bit scans, however full the page file is
+#define SUMMARY_LEVEL1_SIZE_IN_BITS              BITMAP_SIZE_IN_CHUNKS
+#define SUMMARY_LEVEL1_SIZE_IN_CHUNKS            ((SUMMARY_LEVEL1_SIZE_IN_BITS + BITMAP_CHUNK_SIZE_IN_BITS - 1) / BITMAP_CHUNK_SIZE_IN_BITS)
+#define SUMMARY_LEVEL2_SIZE_IN_CHUNKS            ((SUMMARY_LEVEL1_SIZE_IN_CHUNKS + BITMAP_CHUNK_SIZE_IN_BITS - 1) / BITMAP_CHUNK_SIZE_IN_BITS)
 
-#define DISC_INDEX_FAIL_CODE                     0xFFFFFFFFFFFFFFFF
+#define SUMMARY_FAIL_CODE                        0xFFFFFFFFFFFFFFFF
 
 #define MAX_FREED_SPACES_SIZE                    ((ULONG64) 1024)
 
-extern HANDLE pagefile_handle;
-extern PVOID page_file;
+// Freed slots are cached a magazine at a time, so threads only touch shared state once per magazine
+#define FREED_SLOT_MAGAZINE_SIZE                 ((ULONG64) 64)
+#define MAX_FREED_SLOT_MAGAZINES                 (MAX_FREED_SPACES_SIZE / FREED_SLOT_MAGAZINE_SIZE)
+// Every full magazine in the pool, plus a loaded and a spare magazine for every thread that can free slots
+#define NUMBER_OF_FREED_SLOT_MAGAZINES           (MAX_FREED_SLOT_MAGAZINES + 2 * (NUMBER_OF_FAULTING_THREADS + NUMBER_OF_SYSTEM_THREADS))
+
+// Each paging file is a sparse file that grows and shrinks a whole extent at a time
+// The bitmap always covers the largest the files can be, slots of extents and files that are not in use are marked as used
+#define PAGEFILE_EXTENT_SIZE_IN_MB               ((ULONG64) 256)
+#define PAGEFILE_EXTENT_SIZE_IN_PAGES            (MB(PAGEFILE_EXTENT_SIZE_IN_MB) / PAGE_SIZE)
+#define EXTENTS_PER_PAGEFILE                     ((PAGES_PER_PAGEFILE + PAGEFILE_EXTENT_SIZE_IN_PAGES - 1) / PAGEFILE_EXTENT_SIZE_IN_PAGES)
+#define INITIAL_PAGEFILE_EXTENTS                 ((ULONG64) 1)
+
+// A file grows by an extent when fewer free slots than this are left across all of them
+#define PAGEFILE_GROW_THRESHOLD                  (PAGEFILE_EXTENT_SIZE_IN_PAGES / 8)
+// The last extent is given back once this many slots beyond it have stayed free for the whole delay
+// The gap between the two thresholds keeps us from growing and shrinking over the same extent
+#define PAGEFILE_SHRINK_THRESHOLD                (PAGEFILE_EXTENT_SIZE_IN_PAGES / 2)
+#define PAGEFILE_SHRINK_DELAY_IN_SECONDS         ((ULONG64) 16)
+
+// A write of contiguous slots, queued to the I/O thread of the page file that holds them
+typedef struct {
+    LIST_ENTRY entry;
+    ULONG64 disc_index;
+    PVOID src_va;
+    ULONG64 num_pages;
+    // Every request in a batch shares one count, whichever thread finishes the last one signals the batch's event
+    // It also stamps done_time first, so the batch is timed to when its writes finished and not to when it was waited on
+    volatile LONG *pending;
+    PULONG64 done_time;
+    HANDLE done_event;
+} PAGEFILE_WRITE, *PPAGEFILE_WRITE;
+
+typedef struct {
+    char path[MAX_PATH];
+    HANDLE handle;
+    // Share of each batch this file gets, relative to the other files
+    ULONG64 weight;
+    // Used for smooth weighted round robin, the file with the most credit gets the next stripe
+    LONG64 stripe_credit;
+    volatile LONG64 last_checked_index;
+
+    // Each extent in use has its own view of the file, extents that are not in use have none
+    PVOID volatile extent_views[EXTENTS_PER_PAGEFILE];
+    // Extents are always in use from the start of the file, so only the last one can be given back
+    volatile ULONG64 active_extents;
+
+    CRITICAL_SECTION write_queue_lock;
+    LIST_ENTRY write_queue;
+    HANDLE write_queued_event;
+    HANDLE write_thread;
+} PAGEFILE, *PPAGEFILE;
+
+// The most runs get_disc_indices asks for at once
+#define MAX_DISC_RUNS                            ((ULONG64) 64)
+
+// A run of contiguous disc slots, starting at start and covering length slots
+typedef struct {
+    ULONG64 start;
+    ULONG64 length;
+} DISC_RUN, *PDISC_RUN;
+
+// The list entry has to come first, as the lock free lists need it aligned to MEMORY_ALLOCATION_ALIGNMENT
+typedef struct {
+    SLIST_ENTRY entry;
+    ULONG64 count;
+    ULONG64 disc_indices[FREED_SLOT_MAGAZINE_SIZE];
+} FREED_SLOT_MAGAZINE, *PFREED_SLOT_MAGAZINE;
+
+// A set level one bit means that its bitmap chunk matches the summary
+// A set level two bit means that its level one chunk has at least one bit set
+// Bits can be set when they no longer match (the search fixes them), but never clear when they do match
+typedef struct {
+    PBITMAP_CHUNK level1;
+    PBITMAP_CHUNK level2;
+} SUMMARY_BITMAP, *PSUMMARY_BITMAP;
+
+extern PAGEFILE pagefiles[MAX_PAGEFILES];
+// Set with --direct-io, the page files are then opened unbuffered and read and written with ReadFile/WriteFile
+// Otherwise each extent is mapped and copied to, which goes through the OS page cache
+extern BOOLEAN direct_io;
+extern ULONG64 number_of_pagefiles;
+extern CRITICAL_SECTION pagefile_resize_lock;
+extern CRITICAL_SECTION pagefile_stripe_lock;
 
 extern PBITMAP_CHUNK page_file_bitmap;
 extern PBITMAP_CHUNK page_file_bitmap_end;
 
 extern volatile LONG64 free_disc_spot_count;
 
-extern PULONG64 freed_spaces;
-extern volatile LONG64 freed_spaces_size;
+// Chunks with at least one free slot
+extern SUMMARY_BITMAP free_chunk_summary;
+// Chunks where every slot is free
+extern SUMMARY_BITMAP empty_chunk_summary;
 
-extern volatile LONG64 last_checked_index;
+extern PFREED_SLOT_MAGAZINE freed_slot_magazines;
+extern SLIST_HEADER full_magazines;
+extern SLIST_HEADER empty_magazines;
+extern volatile LONG64 full_magazine_count;
 
+extern VOID set_summary_bit(PSUMMARY_BITMAP summary, ULONG64 index);
+extern VOID update_chunk_summaries(ULONG64 chunk_index);
+extern ULONG64 get_disc_runs(PDISC_RUN runs, PULONG64 num_runs, ULONG64 num_indices);
 extern ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices);
 extern VOID free_disc_index(ULONG64 disc_index);
 VOID free_disc_indices(PULONG64 disc_indices, ULONG64 num_indices, ULONG64 start_index);
+extern VOID release_thread_magazine(VOID);
+extern VOID release_thread_direct_io(VOID);
+
+extern VOID activate_pagefile_extent(ULONG64 file_number, ULONG64 extent);
+extern VOID grow_page_file(VOID);
+extern VOID shrink_page_file(VOID);
+
+// Set once the modified writers have exited, which is when the page file I/O threads can stop
+extern HANDLE pagefile_exit_event;
+extern VOID queue_pagefile_writes(PPAGEFILE_WRITE writes, ULONG64 num_writes, volatile LONG *pending,
+                                  PULONG64 done_time, HANDLE done_event);
+extern DWORD pagefile_write_thread(PVOID context);
 
-VOID write_to_pagefile(ULONG64 disc_index, PVOID src_va);
+VOID write_to_pagefile(ULONG64 disc_index, PVOID src_va, ULONG64 num_pages);
 VOID read_from_pagefile(ULONG64 disc_index, PVOID dst_va);
+VOID read_pages_from_pagefile(ULONG64 disc_index, PVOID dst_va, ULONG64 num_pages);
 #endif //PAGEFILE_H
@@ -0,0 +1,48 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pagefile.h"
+
+// With --persist path an orderly shutdown writes every resident page out to the page files
+// And saves where each VA's page lives in a state file, so the next run can pick the address space back up
+// The next run opens the page files as they are and faults pages back in lazily from their disc format PTEs
+#define PERSIST_MAGIC                            ((ULONG64) 0x4554415453534D56)
+#define PERSIST_VERSION                          ((ULONG64) 1)
+
+// How many times shutdown goes around trimming and writing before it gives up on pages it cannot get out
+#define PERSIST_FLUSH_ATTEMPTS                   ((ULONG64) 64)
+#define PERSIST_RETRY_DELAY_IN_MS                10
+
+// Runs are saved and loaded this many at a time
+#define PERSIST_RUN_BUFFER_SIZE                  ((ULONG64) 4096)
+
+typedef struct {
+    ULONG64 magic;
+    ULONG64 version;
+    ULONG64 number_of_ptes;
+    ULONG64 pages_per_pagefile;
+    ULONG64 number_of_pagefiles;
+    char pagefile_paths[MAX_PAGEFILES][MAX_PATH];
+    ULONG64 number_of_runs;
+} PERSIST_HEADER, *PPERSIST_HEADER;
+
+// PTEs next to each other whose pages are on consecutive disc slots are saved as one run
+// The slot bitmap is not saved, as the slots in use are exactly the ones the runs name
+typedef struct {
+    ULONG64 first_pte;
+    ULONG64 disc_index;
+    ULONG64 length;
+} PERSIST_RUN, *PPERSIST_RUN;
+
+extern char persist_path[MAX_PATH];
+// Set when a usable state file was found, the page files are then opened as they are instead of being recreated
+extern BOOLEAN warm_start;
+// Set once the state has been saved, so that the page files are kept at exit
+extern BOOLEAN state_persisted;
+
+extern VOID read_persisted_state(VOID);
+extern VOID load_persisted_state(VOID);
+extern VOID save_persisted_state(VOID);
+
+#endif //PERSIST_H
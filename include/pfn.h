@@ -9,6 +9,12 @@
 //#define ZEROED 2
 #define MODIFIED 3
 #define ACTIVE 4
+// The page is being read in from the paging file with its PTE region unlocked
+// Its PTE is in transition format, and other faults on it wait for the read instead of issuing their own
+#define READ_IN_PROGRESS 5
+
+// A clean resident page keeps the slot of its paging file copy in disc_index, this means it has no copy
+#define NO_DISC_INDEX ((ULONG64) 0xFFFFFFFFFFFFFFFF)
 
 typedef struct {
     // States are FREE, STANDBY, ZEROED (to be added), ACTIVE, and MODIFIED
@@ -16,6 +16,9 @@ typedef struct {
     ULONG64 valid:1;
     ULONG64 frame_number:40;
     ULONG64 age:BITS_PER_AGE;
+    // Set by the fault handler before the user writes to the page, our mappings cannot be made read only to catch it
+    // A page that was never dirtied still matches its paging file copy, so trimming it needs no write
+    ULONG64 dirty:1;
 } VALID_PTE /*, *PVALID_PTE*/;
 
 // We know that a PTE is in disc format if the valid bit is not set and on_disc is set
@@ -67,4 +70,16 @@ extern BOOLEAN try_lock_pte(PPTE pte);
 extern PTE read_pte(PPTE pte);
 extern VOID write_pte(PPTE pte, PTE pte_contents);
 
+// A fault that finds no page ages and trims this many regions and pages itself before it waits
+// Only pages at least this old are trimmed, younger ones are aged so that the next reclaim finds them
+#define DIRECT_RECLAIM_REGIONS                   ((ULONG64) 4)
+#define DIRECT_RECLAIM_BATCH                     ((ULONG64) 16)
+#define DIRECT_RECLAIM_MIN_AGE                   4
+
+extern volatile ULONG64 direct_reclaims;
+extern volatile ULONG64 direct_reclaim_pages;
+
+extern void trim(PPTE pte);
+extern ULONG64 direct_reclaim(PPTE faulting_pte);
+
 #endif //VM_PTE_H
@@ -3,9 +3,36 @@
 #include <Windows.h>
 
 #define MOD_WRITE_TIMES_TO_TRACK                     16
-#define SECONDS_TO_TRACK                             16
+
+// The scheduler keeps the pages we can hand out right away (free plus standby) between these watermarks
+// Below the high watermark it writes modified pages out, below the low watermark it also has the trimmer keep aging
+// Below the min watermark every writer runs flat out and faults are about to start waiting for pages
+#define HIGH_WATERMARK                               (physical_page_count * 3 / 8)
+#define LOW_WATERMARK                                (physical_page_count / 4)
+#define MIN_WATERMARK                                (physical_page_count / 16)
+
+// The scheduler is woken by the available page count crossing a watermark, these timeouts are only a fallback
+// While we are under the low watermark it reevaluates often, as a crossing only wakes it once
+#define SCHEDULER_IDLE_INTERVAL_IN_MS                1000
+#define SCHEDULER_BUSY_INTERVAL_IN_MS                10
+
+// How far ahead the scheduler plans, it tries to have the high watermark's worth of pages by then
+#define SCHEDULER_HORIZON_IN_MS                      100
+
+// The weight the newest sample gets in the consumption and write rate moving averages, in 1/8ths
+#define EWMA_WEIGHT                                  2
+
+// The modified list may hold as many pages as every writer can clean in this long before dirtying threads are paced
+// Pacing starts at half the limit and the pause grows in proportion to how far past that the list is
+#define DIRTY_LIMIT_MS                               1000
+#define DIRTY_LIMIT_MIN                              (MAX_MOD_BATCH * NUMBER_OF_MODIFIED_WRITERS)
+#define DIRTY_LIMIT_MAX                              (physical_page_count / 4)
+#define DIRTY_MAX_PAUSE_MS                           ((ULONG64) 20)
+// A thread checks whether it should be paced once every this many pages it dirties
+#define DIRTY_RATELIMIT_PAGES                        32
 
 typedef struct {
+    // In ns, as a batch usually takes well under a ms
     ULONG64 duration;
     ULONG64 num_pages;
 } MOD_WRITE_TIME, PMOD_WRITE_TIME;
@@ -13,21 +40,26 @@ typedef struct {
 extern MOD_WRITE_TIME mod_write_times[MOD_WRITE_TIMES_TO_TRACK];
 extern ULONG64 mod_write_time_index;
 
-extern ULONG64 available_pages[SECONDS_TO_TRACK];
-extern ULONG64 available_pages_index;
-
 extern ULONG64 num_batches_to_write;
 
-extern MOD_WRITE_TIME average_mod_write_times(VOID);
-extern VOID track_mod_write_time(ULONG64 duration, ULONG64 num_pages);
-
-extern ULONG64 average_page_consumption(VOID);
-extern VOID track_available_pages(ULONG64 available_pages);
+extern HANDLE scheduler_wake_event;
+extern volatile ULONG64 armed_watermark;
+extern volatile ULONG64 pages_consumed;
+extern volatile ULONG64 trim_target;
 
-extern DWORD task_scheduling_thread(PVOID context);
+extern volatile ULONG64 dirty_limit;
+extern volatile ULONG64 dirty_throttles;
+extern volatile ULONG64 dirty_throttle_ms;
 
+extern DOUBLE consumption_rate;
+extern DOUBLE write_rate;
 
+extern MOD_WRITE_TIME average_mod_write_times(VOID);
+extern VOID track_mod_write_time(ULONG64 duration, ULONG64 num_pages);
 
+extern VOID check_watermarks(VOID);
+extern VOID note_page_dirtied(VOID);
 
+extern DWORD task_scheduling_thread(PVOID context);
 
 #endif //SCHEDULER_H
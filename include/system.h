@@ -1,8 +1,88 @@
 #ifndef VM_SYSTEM_H
 #define VM_SYSTEM_H
 #include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+#include "pagefile.h"
 
 #define MAX_MOD_BATCH                   ((ULONG64) 256)
+#define MIN_MOD_BATCH                   ((ULONG64) 16)
+
+// Creates a central switch to turn tuning of the modified write batch size on/off
+// When it is off every batch asks for up to max_mod_batch_size pages, as it always used to
+#define ADAPTIVE_MOD_BATCH              1
+// A batch that takes longer than this from being popped to being on disc is holding its pages too long
+// While the writer has them, faults on them have to wait and the trimmer cannot free them
+#define MOD_BATCH_TARGET_LATENCY_US     ((ULONG64) 4000)
+// The batch size grows by this much at a time and halves when a batch is too slow
+#define MOD_BATCH_STEP                  ((ULONG64) 16)
+// The batch size only grows while the modified list holds at least this many batches of pages
+#define MOD_BATCH_BACKLOG               ((ULONG64) 4)
+
+// Each modified writer pops its own batches, maps them into its own windows and waits on its own writes
+// The writer after the last thread's is for threads that write pages out themselves, like a persisting shutdown
+#define FOREGROUND_WRITER               NUMBER_OF_MODIFIED_WRITERS
+
+// How many batches a modified writer keeps in flight at once, each one has its own window and write event
+// While one batch is on its way to disc the writer pops and maps the next and finishes the one before
+#define MOD_WRITE_PIPELINE_DEPTH        2
+
+// Everything a batch carries from when it is popped to when its pages are finished onto standby
+typedef struct {
+    PVOID write_va;
+    // Set by the page file threads once every write in this batch is on disc
+    HANDLE writes_done_event;
+    volatile LONG pending_writes;
+    ULONG64 num_pages;
+    ULONG64 num_needing_slots;
+    ULONG64 num_zero_pages;
+    ULONG64 num_slotted;
+    // In ns, like every time the writer tracks
+    ULONG64 start_time;
+    // Stamped by the page file thread that finishes the batch's last write, just before it sets writes_done_event
+    ULONG64 writes_done_time;
+    // How many pages the batch asked for, it is only used to tune the batch size if it got all of them
+    ULONG64 target_pages;
+    ULONG_PTR frame_numbers[MAX_MOD_BATCH];
+    ULONG64 disc_indices[MAX_MOD_BATCH];
+    PPTE ptes[MAX_MOD_BATCH];
+    BOOLEAN needs_write[MAX_MOD_BATCH];
+    ULONG64 hashes[MAX_MOD_BATCH];
+    PAGEFILE_WRITE writes[MAX_MOD_BATCH];
+} MOD_WRITE_BATCH, *PMOD_WRITE_BATCH;
+
+typedef struct {
+    HANDLE wake_event;
+    // When this writer's last batch finished, overlapping batches are only timed from here
+    ULONG64 last_finish_time;
+    MOD_WRITE_BATCH batches[MOD_WRITE_PIPELINE_DEPTH];
+} MODIFIED_WRITER, *PMODIFIED_WRITER;
+
+// One page windows in our own VA space that any thread can borrow to map a frame for a moment
+// Faults read pages in and zero repurposed pages through these, so they do not take turns on one shared window
+// A window only costs a page of reserved VA, so there are enough that a thread almost never finds the pool empty
+#define NUMBER_OF_PAGE_WINDOWS          ((ULONG64) 64)
+
+// The list entry has to come first, as the lock free list needs it aligned to MEMORY_ALLOCATION_ALIGNMENT
+typedef struct {
+    SLIST_ENTRY entry;
+    PVOID va;
+} PAGE_WINDOW, *PPAGE_WINDOW;
+
+// A fault that found no page at all waits in a FIFO queue, and is handed a page directly by whoever frees one
+// The page is written into the waiter's entry, which the waiter waits on with WaitOnAddress
+typedef struct {
+    LIST_ENTRY entry;
+    PVOID volatile pfn;
+} PAGE_WAITER, *PPAGE_WAITER;
+
+// Creates a central switch to turn ordering each modified write batch by VA on/off
+// The modified list is in trim order, sorting a batch lets pages next to each other in the VA space get consecutive slots
+#define VA_CLUSTERED_WRITES             1
+
+// Creates a central switch to turn zero page detection in the modified writer on/off
+// Pages that are entirely zero are turned back into demand zero PTEs instead of being written out
+#define ZERO_PAGE_DETECTION             1
 
 #define NULL_CHECK(x, msg)       if (x == NULL) {fatal_error(msg); }
 
@@ -12,24 +92,43 @@ extern ULONG_PTR virtual_address_size;
 extern PVOID va_base;
 extern PVOID va__end;
 
-extern PVOID modified_write_va;
-extern PVOID modified_read_va;
-extern PVOID repurpose_zero_va;
+extern PPAGE_WINDOW page_windows;
+extern SLIST_HEADER free_page_windows;
+
+extern PPAGE_WINDOW take_page_window(VOID);
+extern VOID release_page_window(PPAGE_WINDOW window);
 
-extern CRITICAL_SECTION modified_write_va_lock;
-extern CRITICAL_SECTION modified_read_va_lock;
-extern CRITICAL_SECTION repurpose_zero_va_lock;
+extern volatile ULONG64 zero_pages_skipped;
+extern volatile ULONG64 read_collisions;
+extern volatile ULONG64 prefaulted_pages;
+extern volatile ULONG64 clean_pages_trimmed;
 
 extern HANDLE wake_aging_event;
-extern HANDLE modified_writing_event;
-extern HANDLE pages_available_event;
+extern LIST_ENTRY page_waiters;
+extern CRITICAL_SECTION page_waiters_lock;
+extern volatile LONG64 num_page_waiters;
+
+extern VOID hand_pages_to_waiters(VOID);
 extern HANDLE disc_spot_available_event;
 extern HANDLE system_exit_event;
 extern HANDLE system_start_event;
 
 extern DWORD modified_write_thread(PVOID context);
 extern DWORD trim_thread(PVOID context);
+extern BOOLEAN write_pages_to_disc(PMODIFIED_WRITER writer);
+
+extern MODIFIED_WRITER modified_writers[NUMBER_OF_MODIFIED_WRITERS + 1];
+extern volatile ULONG64 active_modified_writers;
+
+extern volatile ULONG64 mod_write_batch_size;
+extern ULONG64 min_mod_batch_size;
+extern ULONG64 max_mod_batch_size;
+extern volatile ULONG64 va_adjacent_writes;
+extern volatile ULONG64 va_contiguous_writes;
+extern volatile ULONG64 mod_write_batches_sized;
+extern volatile ULONG64 mod_write_batch_size_total;
 
+extern VOID parse_arguments(int argc, char **argv);
 extern VOID initialize_system(VOID);
 extern VOID run_system(VOID);
 extern VOID deinitialize_system(VOID);
@@ -37,5 +136,9 @@ extern VOID deinitialize_system(VOID);
 extern VOID fatal_error(char *msg);
 extern VOID map_pages(PVOID user_va, ULONG_PTR page_count, PULONG_PTR page_array);
 extern VOID unmap_pages(PVOID user_va, ULONG_PTR page_count);
+extern VOID map_pages_scatter(PVOID *virtual_addresses, ULONG_PTR num_pages, PULONG_PTR page_array);
+extern VOID unmap_pages_scatter(PVOID *virtual_addresses, ULONG_PTR num_pages);
+extern PVOID get_region_window(VOID);
+extern VOID release_region_window(VOID);
 
 #endif //VM_SYSTEM_H
@@ -0,0 +1,18 @@
+#ifndef TIMING_H
+#define TIMING_H
+#include <Windows.h>
+
+// How long the TSC is measured against QueryPerformanceCounter to find its frequency
+#define TSC_CALIBRATION_MS                       ((ULONG64) 50)
+
+#define NS_PER_MS                                ((ULONG64) 1000000)
+#define NS_PER_SECOND                            ((ULONG64) 1000000000)
+
+// Set when the CPU has an invariant TSC, which ticks at a constant rate across cores and power states
+// Without one we fall back to QueryPerformanceCounter, which is slower to read but just as monotonic
+extern BOOLEAN tsc_usable;
+
+extern VOID initialize_timing(VOID);
+extern ULONG64 get_time_ns(VOID);
+
+#endif //TIMING_H
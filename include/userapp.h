@@ -4,14 +4,20 @@
 #include <Windows.h>
 #include "hardware.h"
 #include "debug.h"
+#include "vad.h"
 
 extern PULONG faulting_thread_ids;
 
 extern ULONG64 num_trims;
 
-extern PVOID allocate_memory(PULONG_PTR num_bytes);
+// Tells the fault handler whether the user is about to write to the page, a write must be announced before it is made
+#define READ_ACCESS                              0
+#define WRITE_ACCESS                             1
+
 // Eventually an API I code will do this instead of directly passing this to the page fault handler
-extern VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats);
+extern VOID page_fault_handler(PVOID arbitrary_va, ULONG access_type, PFAULT_STATS stats);
+// Resolves a whole range ahead of time, access_type is the hint of whether it is about to be read or written
+extern ULONG64 prefault_range(PVOID virtual_address, ULONG64 num_bytes, ULONG access_type);
 
 extern DWORD faulting_thread(PVOID context);
 #endif //VM_USERAPP_H
@@ -0,0 +1,38 @@
+#ifndef VAD_H
+#define VAD_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+
+// Each allocation is described by a VAD, which covers a range of pages of our VA space
+// The VADs are kept in an AVL tree ordered by their first page, so finding the one a VA is in takes O(log n)
+// Pages of a VAD are reserved until they are committed, a fault on a page that is not committed is an access violation
+typedef struct _VAD {
+    struct _VAD *left;
+    struct _VAD *right;
+    ULONG64 height;
+    // Both are in pages from va_base, which is also the index of the page's PTE
+    ULONG64 start_page;
+    ULONG64 num_pages;
+    // One bit per page, set while the page is committed
+    PULONG64 commit_bitmap;
+} VAD, *PVAD;
+
+extern PVAD vad_root;
+// Faults only read the tree, so they share this lock. It comes after PTE locks and is never held while taking one
+extern SRWLOCK vad_lock;
+
+// Counts the pages that were given back while they still had a frame or a disc slot
+extern volatile ULONG64 vad_pages_released;
+
+extern PVOID reserve_memory(ULONG64 num_bytes);
+extern BOOLEAN commit_memory(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN decommit_memory(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN free_memory(PVOID virtual_address);
+extern PVOID allocate_memory(ULONG64 num_bytes);
+
+extern BOOLEAN is_committed(PVOID virtual_address);
+extern BOOLEAN get_vad_range(PVOID virtual_address, PULONG64 first_page, PULONG64 num_pages);
+extern VOID free_vad_tree(PVAD vad);
+
+#endif //VAD_H
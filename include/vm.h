@@ -8,5 +8,10 @@
 #include "pagefile.h"
 #include "console.h"
 #include "scheduler.h"
+#include "compressed_cache.h"
+#include "dedup.h"
+#include "persist.h"
+#include "timing.h"
+#include "vad.h"
 
 #endif //VM_VM_H
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/userapp.h"
+#include "../include/benchmarks.h"
+
+HANDLE benchmark_start_event;
+volatile LONG64 benchmark_stop;
+ULONG benchmark_num_threads;
+
+// The range the decommit benchmark threads fault on, each thread owns every benchmark_num_threads-th chunk of it
+PULONG_PTR decommit_benchmark_range;
+ULONG64 decommit_benchmark_pages;
+
+// Each thread counts its own operations in its own cache line, so the counting does not become the bottleneck
+typedef struct {
+    DECLSPEC_ALIGN(64) ULONG64 operations;
+} BENCHMARK_COUNTER, *PBENCHMARK_COUNTER;
+
+BENCHMARK_COUNTER benchmark_counters[MAX_BENCHMARK_THREADS];
+
+DWORD disc_slot_benchmark_thread(PVOID context)
+{
+    PBENCHMARK_COUNTER counter = (PBENCHMARK_COUNTER) context;
+    ULONG64 disc_indices[DISC_SLOT_BENCHMARK_BATCH];
+    ULONG64 num_indices;
+
+    WaitForSingleObject(benchmark_start_event, INFINITE);
+
+    while (*(volatile LONG64 *) &benchmark_stop == 0)
+    {
+        num_indices = get_disc_indices(disc_indices, DISC_SLOT_BENCHMARK_BATCH);
+        free_disc_indices(disc_indices, num_indices, 0);
+
+        counter->operations += num_indices;
+    }
+
+    release_thread_magazine();
+    release_thread_direct_io();
+    release_region_window();
+    return 0;
+}
+
+// Does what a hard fault does once it has a page and knows its slot: borrows a window, maps the page into it,
+// Reads the slot from the page file and unmaps it. Each thread has its own page and slot, so only the windows are shared
+DWORD hard_fault_read_benchmark_thread(PVOID context)
+{
+    PBENCHMARK_COUNTER counter = (PBENCHMARK_COUNTER) context;
+    ULONG64 disc_index;
+    PPFN pfn = pop_from_list_head(&free_page_list);
+    NULL_CHECK(pfn, "hard_fault_read_benchmark_thread : there were no free pages to read into")
+    ULONG_PTR frame_number = frame_number_from_pfn(pfn);
+
+    // The page is off every list, so no one else can find it while it is unlocked and we only need its frame
+    // It must not stay locked, a thread that exits holding a PFN lock leaves it held for good
+    unlock_pfn(pfn);
+
+    if (get_disc_indices(&disc_index, 1) != 1) {
+        fatal_error("hard_fault_read_benchmark_thread : there were no disc slots to read from");
+    }
+
+    WaitForSingleObject(benchmark_start_event, INFINITE);
+
+    while (*(volatile LONG64 *) &benchmark_stop == 0)
+    {
+        PPAGE_WINDOW window = take_page_window();
+        map_pages(window->va, 1, &frame_number);
+        read_from_pagefile(disc_index, window->va);
+        unmap_pages(window->va, 1);
+        release_page_window(window);
+
+        counter->operations++;
+    }
+
+    free_disc_index(disc_index);
+    release_thread_magazine();
+    release_thread_direct_io();
+    release_region_window();
+
+    lock_pfn(pfn);
+    EnterCriticalSection(&free_page_list.lock);
+    add_to_list_tail(pfn, &free_page_list);
+    LeaveCriticalSection(&free_page_list.lock);
+    unlock_pfn(pfn);
+    return 0;
+}
+
+// Touches a page the same way the faulting threads do, going back into the handler until the access goes through
+// A page holding anything other than what we expect means a frame was given back without being zeroed or was mixed up
+VOID benchmark_access_page(PULONG_PTR va, ULONG access_type, ULONG_PTR expected, PFAULT_STATS stats)
+{
+    BOOLEAN page_faulted;
+    ULONG_PTR local;
+
+    do {
+        page_fault_handler(va, access_type, stats);
+
+        page_faulted = FALSE;
+        __try
+        {
+            local = *va;
+            if (local != expected) {
+                fatal_error("benchmark_access_page : page contents are not what was last written to them");
+            }
+            if (access_type == WRITE_ACCESS) {
+                *va = (ULONG_PTR) va;
+            }
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            page_faulted = TRUE;
+        }
+    } while (page_faulted == TRUE);
+}
+
+// Writes every page of a chunk, reads them all back and decommits the chunk, then commits it again for the next round
+// The chunks of different threads share PTE regions, so each decommit runs while other threads fault right next to it
+DWORD decommit_benchmark_thread(PVOID context)
+{
+    PBENCHMARK_COUNTER counter = (PBENCHMARK_COUNTER) context;
+    ULONG64 thread_index = counter - benchmark_counters;
+    ULONG64 num_chunks = decommit_benchmark_pages / DECOMMIT_BENCHMARK_CHUNK;
+    ULONG64 chunk = thread_index;
+    FAULT_STATS stats;
+
+    memset(&stats, 0, sizeof(FAULT_STATS));
+
+    WaitForSingleObject(benchmark_start_event, INFINITE);
+
+    while (*(volatile LONG64 *) &benchmark_stop == 0)
+    {
+        PULONG_PTR chunk_start = decommit_benchmark_range + chunk * DECOMMIT_BENCHMARK_CHUNK * PAGE_SIZE / sizeof(ULONG_PTR);
+
+        for (ULONG64 i = 0; i < DECOMMIT_BENCHMARK_CHUNK; i++)
+        {
+            PULONG_PTR va = chunk_start + i * PAGE_SIZE / sizeof(ULONG_PTR);
+            benchmark_access_page(va, WRITE_ACCESS, 0, &stats);
+        }
+
+        for (ULONG64 i = 0; i < DECOMMIT_BENCHMARK_CHUNK; i++)
+        {
+            PULONG_PTR va = chunk_start + i * PAGE_SIZE / sizeof(ULONG_PTR);
+            benchmark_access_page(va, READ_ACCESS, (ULONG_PTR) va, &stats);
+        }
+
+        if (decommit_memory(chunk_start, DECOMMIT_BENCHMARK_CHUNK * PAGE_SIZE) == FALSE ||
+            commit_memory(chunk_start, DECOMMIT_BENCHMARK_CHUNK * PAGE_SIZE) == FALSE) {
+            fatal_error("decommit_benchmark_thread : could not decommit and recommit a chunk of the benchmark range");
+        }
+
+        counter->operations += DECOMMIT_BENCHMARK_CHUNK;
+
+        chunk += benchmark_num_threads;
+        if (chunk >= num_chunks) {
+            chunk = thread_index;
+        }
+    }
+
+    release_thread_magazine();
+    release_thread_direct_io();
+    release_region_window();
+    return 0;
+}
+
+// Runs a benchmark body on num_threads threads at once for BENCHMARK_DURATION_MS
+// Returns the total number of operations every thread completed per second of measured time
+// Sleep can overshoot by a scheduler tick, so the rate is taken over the time the threads were actually running
+ULONG64 run_benchmark_threads(LPTHREAD_START_ROUTINE thread_function, ULONG num_threads)
+{
+    HANDLE handles[MAX_BENCHMARK_THREADS];
+    ULONG64 total_operations = 0;
+
+    ResetEvent(benchmark_start_event);
+    benchmark_stop = 0;
+    benchmark_num_threads = num_threads;
+
+    for (ULONG i = 0; i < num_threads; i++)
+    {
+        benchmark_counters[i].operations = 0;
+        handles[i] = CreateThread(NULL, 0, thread_function, &benchmark_counters[i], 0, NULL);
+        NULL_CHECK(handles[i], "run_benchmark_threads : could not create benchmark thread")
+    }
+
+    ULONG64 start_time = get_time_ns();
+    SetEvent(benchmark_start_event);
+    Sleep((DWORD) BENCHMARK_DURATION_MS);
+    InterlockedExchange64(&benchmark_stop, 1);
+
+    WaitForMultipleObjects(num_threads, handles, TRUE, INFINITE);
+    ULONG64 elapsed = get_time_ns() - start_time;
+
+    for (ULONG i = 0; i < num_threads; i++)
+    {
+        total_operations += benchmark_counters[i].operations;
+        CloseHandle(handles[i]);
+    }
+
+    return (ULONG64) ((DOUBLE) total_operations * NS_PER_SECOND / (DOUBLE) elapsed);
+}
+
+// Measures how many disc slots can be allocated and freed per second as threads are added
+// Every slot is given back, so the allocator has to end up exactly where it started
+VOID disc_slot_benchmark(VOID)
+{
+    LONG64 initial_free_count = free_disc_spot_count;
+
+    for (ULONG num_threads = 1; num_threads <= MAX_BENCHMARK_THREADS; num_threads *= 2)
+    {
+        ULONG64 operations = run_benchmark_threads(disc_slot_benchmark_thread, num_threads);
+
+        printf("disc_slot_benchmark : %2lu threads allocated and freed %llu slots per second\n",
+               num_threads, operations);
+
+        if (free_disc_spot_count != initial_free_count) {
+            fatal_error("disc_slot_benchmark : free_disc_spot_count does not match the slots that were given back");
+        }
+    }
+}
+
+// Measures how many hard fault reads per second go through as threads are added
+// Before faults had their own windows this stayed flat, as every read took the same lock
+VOID hard_fault_read_benchmark(VOID)
+{
+    for (ULONG num_threads = 1; num_threads <= MAX_BENCHMARK_THREADS; num_threads *= 2)
+    {
+        ULONG64 operations = run_benchmark_threads(hard_fault_read_benchmark_thread, num_threads);
+
+        printf("hard_fault_read_benchmark : %2lu threads read %llu pages per second\n", num_threads, operations);
+    }
+}
+
+// Measures how many pages per second can be faulted in, read back and decommitted while other threads do the same
+// In the same PTE regions. The trimmer and the modified writers only start with the system,
+// So the range is kept to half of memory, where every fault can still be given a free page
+VOID decommit_benchmark(VOID)
+{
+    decommit_benchmark_pages = physical_page_count / 2 / DECOMMIT_BENCHMARK_CHUNK * DECOMMIT_BENCHMARK_CHUNK;
+    decommit_benchmark_range = (PULONG_PTR) allocate_memory(decommit_benchmark_pages * PAGE_SIZE);
+    NULL_CHECK(decommit_benchmark_range, "decommit_benchmark : could not allocate the benchmark range")
+
+    for (ULONG num_threads = 1; num_threads <= MAX_BENCHMARK_THREADS; num_threads *= 2)
+    {
+        ULONG64 operations = run_benchmark_threads(decommit_benchmark_thread, num_threads);
+
+        printf("decommit_benchmark : %2lu threads faulted in and decommitted %llu pages per second\n",
+               num_threads, operations);
+    }
+
+    free_memory(decommit_benchmark_range);
+    release_region_window();
+}
+
+VOID run_benchmarks(VOID)
+{
+    benchmark_start_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    NULL_CHECK(benchmark_start_event, "run_benchmarks : could not create benchmark_start_event")
+
+    disc_slot_benchmark();
+    hard_fault_read_benchmark();
+    decommit_benchmark();
+
+    CloseHandle(benchmark_start_event);
+}
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+// The compressed cache sits between the standby list and the paging file
+// The modified writer compresses pages into it, and faults on those pages decompress them without any disc read
+// When it runs out of room, its oldest entries are written back to the paging file to make space
+
+#define LZ_MIN_MATCH                             ((ULONG64) 4)
+#define LZ_HASH_BITS                             12
+
+CRITICAL_SECTION compressed_cache_lock;
+
+// Compressed blocks are carved out of this arena in size classes, and are reused within their class once freed
+PUCHAR compressed_arena;
+ULONG64 compressed_arena_used;
+PVOID compressed_block_free_lists[NUMBER_OF_SIZE_CLASSES];
+
+PCOMPRESSED_ENTRY compressed_entries;
+LIST_ENTRY compressed_entry_free_list;
+LIST_ENTRY compressed_lru;
+
+volatile ULONG64 compressed_pages_stored;
+volatile ULONG64 compressed_pages_rejected;
+volatile ULONG64 compressed_pages_loaded;
+volatile ULONG64 compressed_pages_written_back;
+
+VOID write_back_compressed_pages(ULONG64 num_pages);
+
+BOOLEAN is_entry_list_empty(PLIST_ENTRY listhead)
+{
+    return listhead->Flink == listhead;
+}
+
+VOID unlink_compressed_entry(PCOMPRESSED_ENTRY entry)
+{
+    entry->entry.Blink->Flink = entry->entry.Flink;
+    entry->entry.Flink->Blink = entry->entry.Blink;
+}
+
+VOID insert_compressed_entry_head(PLIST_ENTRY listhead, PCOMPRESSED_ENTRY entry)
+{
+    PLIST_ENTRY first_entry = listhead->Flink;
+    entry->entry.Flink = first_entry;
+    entry->entry.Blink = listhead;
+    first_entry->Blink = &entry->entry;
+    listhead->Flink = &entry->entry;
+}
+
+ULONG lz_hash(ULONG sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+ULONG read_sequence(PUCHAR address)
+{
+    ULONG sequence;
+    memcpy(&sequence, address, sizeof(ULONG));
+    return sequence;
+}
+
+// Lengths that do not fit in a token nibble continue in bytes of 255 and end with a byte under 255
+BOOLEAN write_length(PUCHAR dst, PULONG64 out, ULONG64 capacity, ULONG64 length)
+{
+    while (length >= 255)
+    {
+        if (*out >= capacity) {
+            return FALSE;
+        }
+        dst[(*out)++] = 255;
+        length -= 255;
+    }
+
+    if (*out >= capacity) {
+        return FALSE;
+    }
+    dst[(*out)++] = (UCHAR) length;
+    return TRUE;
+}
+
+// Writes one sequence: a token, the literals before the match, and the match itself
+// A match_length of zero marks the final sequence, which only has literals
+BOOLEAN write_sequence(PUCHAR dst, PULONG64 out, ULONG64 capacity, PUCHAR literals, ULONG64 literal_length,
+                       ULONG64 offset, ULONG64 match_length)
+{
+    ULONG64 match_code = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+    UCHAR token = (UCHAR) ((min(literal_length, 15) << 4) | min(match_code, 15));
+
+    if (*out >= capacity) {
+        return FALSE;
+    }
+    dst[(*out)++] = token;
+
+    if (literal_length >= 15 && write_length(dst, out, capacity, literal_length - 15) == FALSE) {
+        return FALSE;
+    }
+
+    if (*out + literal_length > capacity) {
+        return FALSE;
+    }
+    memcpy(dst + *out, literals, literal_length);
+    *out += literal_length;
+
+    if (match_length == 0) {
+        return TRUE;
+    }
+
+    if (*out + 2 > capacity) {
+        return FALSE;
+    }
+    dst[(*out)++] = (UCHAR) (offset & 0xFF);
+    dst[(*out)++] = (UCHAR) (offset >> 8);
+
+    if (match_code >= 15 && write_length(dst, out, capacity, match_code - 15) == FALSE) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// This is a small LZ77 compressor in the style of LZ4, made for single pages
+// It finds matches through a hash table of the last position each 4 byte sequence was seen at
+// Returns the compressed size, or 0 if the page does not fit in capacity bytes
+ULONG64 compress_page(PUCHAR src, PUCHAR dst, ULONG64 capacity)
+{
+    // Positions are stored plus one, so that zero means the sequence has not been seen
+    USHORT last_seen[1 << LZ_HASH_BITS];
+    ULONG64 in = 0;
+    ULONG64 anchor = 0;
+    ULONG64 out = 0;
+
+    memset(last_seen, 0, sizeof(last_seen));
+
+    while (in + LZ_MIN_MATCH <= PAGE_SIZE)
+    {
+        ULONG sequence = read_sequence(src + in);
+        ULONG hash = lz_hash(sequence);
+        ULONG64 candidate = last_seen[hash];
+
+        last_seen[hash] = (USHORT) (in + 1);
+
+        if (candidate == 0 || read_sequence(src + candidate - 1) != sequence)
+        {
+            in++;
+            continue;
+        }
+
+        ULONG64 match = candidate - 1;
+        ULONG64 match_length = LZ_MIN_MATCH;
+        while (in + match_length < PAGE_SIZE && src[match + match_length] == src[in + match_length])
+        {
+            match_length++;
+        }
+
+        if (write_sequence(dst, &out, capacity, src + anchor, in - anchor, in - match, match_length) == FALSE) {
+            return 0;
+        }
+
+        in += match_length;
+        anchor = in;
+    }
+
+    if (write_sequence(dst, &out, capacity, src + anchor, PAGE_SIZE - anchor, 0, 0) == FALSE) {
+        return 0;
+    }
+    return out;
+}
+
+// Reads a length that continues past its token nibble
+BOOLEAN read_length(PUCHAR src, PULONG64 in, ULONG64 size, PULONG64 length)
+{
+    UCHAR byte;
+
+    do {
+        if (*in >= size) {
+            return FALSE;
+        }
+        byte = src[(*in)++];
+        *length += byte;
+    } while (byte == 255);
+
+    return TRUE;
+}
+
+// Returns the number of bytes written to dst, which is PAGE_SIZE for any block made by compress_page
+ULONG64 decompress_page(PUCHAR src, ULONG64 size, PUCHAR dst)
+{
+    ULONG64 in = 0;
+    ULONG64 out = 0;
+
+    while (in < size)
+    {
+        UCHAR token = src[in++];
+        ULONG64 literal_length = token >> 4;
+        ULONG64 match_length = token & 0xF;
+
+        if (literal_length == 15 && read_length(src, &in, size, &literal_length) == FALSE) {
+            return 0;
+        }
+        if (in + literal_length > size || out + literal_length > PAGE_SIZE) {
+            return 0;
+        }
+        memcpy(dst + out, src + in, literal_length);
+        in += literal_length;
+        out += literal_length;
+
+        // The final sequence has no match after its literals
+        if (in == size) {
+            break;
+        }
+
+        if (in + 2 > size) {
+            return 0;
+        }
+        ULONG64 offset = src[in] | ((ULONG64) src[in + 1] << 8);
+        in += 2;
+
+        if (match_length == 15 && read_length(src, &in, size, &match_length) == FALSE) {
+            return 0;
+        }
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || out + match_length > PAGE_SIZE) {
+            return 0;
+        }
+
+        // Matches can overlap what they are copying, so they are copied a byte at a time
+        for (ULONG64 i = 0; i < match_length; i++)
+        {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += match_length;
+    }
+
+    return out;
+}
+
+ULONG64 compressed_index_from_entry(PCOMPRESSED_ENTRY entry)
+{
+    return COMPRESSED_INDEX_BIT | (ULONG64) (entry - compressed_entries);
+}
+
+PCOMPRESSED_ENTRY entry_from_compressed_index(ULONG64 compressed_index)
+{
+    ULONG64 index = compressed_index & ~COMPRESSED_INDEX_BIT;
+
+    if (IS_COMPRESSED_INDEX(compressed_index) == FALSE || index >= MAX_COMPRESSED_ENTRIES) {
+        fatal_error("entry_from_compressed_index : compressed index is out of valid range");
+    }
+    return &compressed_entries[index];
+}
+
+// Called with the compressed cache lock held
+PUCHAR allocate_compressed_block(ULONG64 size_class)
+{
+    PUCHAR block = compressed_block_free_lists[size_class];
+
+    if (block != NULL) {
+        compressed_block_free_lists[size_class] = *(PVOID *) block;
+        return block;
+    }
+
+    ULONG64 block_size = (size_class + 1) * COMPRESSED_BLOCK_GRANULE;
+    if (compressed_arena_used + block_size > COMPRESSED_CACHE_SIZE_IN_BYTES) {
+        return NULL;
+    }
+
+    block = compressed_arena + compressed_arena_used;
+    compressed_arena_used += block_size;
+    return block;
+}
+
+// Called with the compressed cache lock held
+VOID release_compressed_entry(PCOMPRESSED_ENTRY entry)
+{
+    if (entry->on_lru) {
+        unlink_compressed_entry(entry);
+        entry->on_lru = FALSE;
+    }
+
+    *(PVOID *) entry->block = compressed_block_free_lists[entry->size_class];
+    compressed_block_free_lists[entry->size_class] = entry->block;
+
+    entry->block = NULL;
+    entry->pte = NULL;
+    insert_tail_list(&compressed_entry_free_list, &entry->entry);
+}
+
+// Called with the compressed cache lock held
+PCOMPRESSED_ENTRY allocate_compressed_entry(ULONG64 size_class)
+{
+    if (is_entry_list_empty(&compressed_entry_free_list)) {
+        return NULL;
+    }
+
+    PUCHAR block = allocate_compressed_block(size_class);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    PCOMPRESSED_ENTRY entry = CONTAINING_RECORD(compressed_entry_free_list.Flink, COMPRESSED_ENTRY, entry);
+    unlink_compressed_entry(entry);
+    entry->block = block;
+    entry->size_class = (UCHAR) size_class;
+    entry->on_lru = FALSE;
+    return entry;
+}
+
+// Compresses a page mapped at page_va into the cache
+// Returns the compressed index the owner of the page should record, or DISC_INDEX_FAIL_CODE if the page
+// Did not compress well enough or there was no room for it even after writing the oldest entries back
+ULONG64 store_compressed_page(PVOID page_va, PPTE pte)
+{
+    UCHAR compressed[MAX_COMPRESSED_PAGE_SIZE];
+    PCOMPRESSED_ENTRY entry;
+
+    ULONG64 compressed_size = compress_page(page_va, compressed, MAX_COMPRESSED_PAGE_SIZE);
+    if (compressed_size == 0)
+    {
+        InterlockedIncrement64((volatile LONG64 *) &compressed_pages_rejected);
+        return DISC_INDEX_FAIL_CODE;
+    }
+
+    ULONG64 size_class = (compressed_size - 1) / COMPRESSED_BLOCK_GRANULE;
+
+    EnterCriticalSection(&compressed_cache_lock);
+    entry = allocate_compressed_entry(size_class);
+    LeaveCriticalSection(&compressed_cache_lock);
+
+    if (entry == NULL)
+    {
+        write_back_compressed_pages(COMPRESSED_WRITEBACK_BATCH);
+
+        EnterCriticalSection(&compressed_cache_lock);
+        entry = allocate_compressed_entry(size_class);
+        LeaveCriticalSection(&compressed_cache_lock);
+
+        if (entry == NULL)
+        {
+            InterlockedIncrement64((volatile LONG64 *) &compressed_pages_rejected);
+            return DISC_INDEX_FAIL_CODE;
+        }
+    }
+
+    // Nothing else can see the entry until it is published, so the copy is done without the lock
+    memcpy(entry->block, compressed, compressed_size);
+    entry->compressed_size = (USHORT) compressed_size;
+    entry->pte = pte;
+
+    InterlockedIncrement64((volatile LONG64 *) &compressed_pages_stored);
+    return compressed_index_from_entry(entry);
+}
+
+// Makes an entry a candidate for writeback, once its owner's PFN actually holds its compressed index
+// Until then, writing it back would leave nobody to point at the new disc slot
+VOID publish_compressed_page(ULONG64 compressed_index)
+{
+    PCOMPRESSED_ENTRY entry = entry_from_compressed_index(compressed_index);
+
+    EnterCriticalSection(&compressed_cache_lock);
+    insert_tail_list(&compressed_lru, &entry->entry);
+    entry->on_lru = TRUE;
+    LeaveCriticalSection(&compressed_cache_lock);
+}
+
+// Decompresses an entry into a page mapped at dst_va
+// The caller holds the lock on the PTE that owns the entry, so the entry cannot be freed or written back under us
+VOID load_compressed_page(ULONG64 compressed_index, PVOID dst_va)
+{
+    PCOMPRESSED_ENTRY entry = entry_from_compressed_index(compressed_index);
+
+    if (decompress_page(entry->block, entry->compressed_size, dst_va) != PAGE_SIZE) {
+        fatal_error("load_compressed_page : compressed page is corrupt");
+    }
+
+    InterlockedIncrement64((volatile LONG64 *) &compressed_pages_loaded);
+}
+
+VOID free_compressed_page(ULONG64 compressed_index)
+{
+    PCOMPRESSED_ENTRY entry = entry_from_compressed_index(compressed_index);
+
+    EnterCriticalSection(&compressed_cache_lock);
+    release_compressed_entry(entry);
+    LeaveCriticalSection(&compressed_cache_lock);
+}
+
+// Points whoever owns a compressed entry at the disc slot it was just written back to
+// Called with the PTE lock held. If the page is still resident its PFN holds the index, otherwise its PTE does
+VOID move_compressed_owner_to_disc(PPTE pte, ULONG64 compressed_index, ULONG64 disc_index)
+{
+    PTE pte_contents = read_pte(pte);
+    PPFN pfn;
+
+    if (pte_contents.memory_format.valid == 0 && pte_contents.disc_format.on_disc == 0)
+    {
+        // Standby pages can be repurposed while only holding their PFN lock, which moves the index to the PTE
+        // So the PTE has to be read again once we hold the PFN lock too
+        pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
+        lock_pfn(pfn);
+
+        pte_contents = read_pte(pte);
+        if (pte_contents.disc_format.on_disc == 0)
+        {
+            if (pfn->disc_index == compressed_index) {
+                pfn->disc_index = disc_index;
+            }
+            unlock_pfn(pfn);
+            return;
+        }
+        unlock_pfn(pfn);
+    }
+
+    if (pte_contents.disc_format.on_disc == 1 && pte_contents.disc_format.disc_index == compressed_index)
+    {
+        pte_contents.disc_format.disc_index = disc_index;
+        write_pte(pte, pte_contents);
+    }
+}
+
+// Writes up to num_pages of the oldest entries back to the paging file and frees them
+// Entries whose PTE region is busy are left alone, we never wait on a PTE lock while deciding what to evict
+VOID write_back_compressed_pages(ULONG64 num_pages)
+{
+    UCHAR page[PAGE_SIZE];
+    PCOMPRESSED_ENTRY entry;
+    ULONG64 disc_index;
+
+    for (ULONG64 i = 0; i < num_pages; i++)
+    {
+        EnterCriticalSection(&compressed_cache_lock);
+
+        if (is_entry_list_empty(&compressed_lru))
+        {
+            LeaveCriticalSection(&compressed_cache_lock);
+            return;
+        }
+
+        entry = CONTAINING_RECORD(compressed_lru.Flink, COMPRESSED_ENTRY, entry);
+
+        // Holding the PTE lock keeps faults from freeing or loading the entry while we move it
+        if (try_lock_pte(entry->pte) == FALSE)
+        {
+            LeaveCriticalSection(&compressed_cache_lock);
+            return;
+        }
+
+        unlink_compressed_entry(entry);
+        entry->on_lru = FALSE;
+        LeaveCriticalSection(&compressed_cache_lock);
+
+        PPTE pte = entry->pte;
+        ULONG64 compressed_index = compressed_index_from_entry(entry);
+
+        if (get_disc_indices(&disc_index, 1) == 0)
+        {
+            // There is nowhere to put it, so it stays in the cache
+            EnterCriticalSection(&compressed_cache_lock);
+            insert_compressed_entry_head(&compressed_lru, entry);
+            entry->on_lru = TRUE;
+            LeaveCriticalSection(&compressed_cache_lock);
+
+            unlock_pte(pte);
+            return;
+        }
+
+        if (decompress_page(entry->block, entry->compressed_size, page) != PAGE_SIZE) {
+            fatal_error("write_back_compressed_pages : compressed page is corrupt");
+        }
+        write_to_pagefile(disc_index, page, 1);
+
+        move_compressed_owner_to_disc(pte, compressed_index, disc_index);
+
+        EnterCriticalSection(&compressed_cache_lock);
+        release_compressed_entry(entry);
+        LeaveCriticalSection(&compressed_cache_lock);
+
+        unlock_pte(pte);
+
+        InterlockedIncrement64((volatile LONG64 *) &compressed_pages_written_back);
+    }
+}
+
+VOID print_compressed_cache_stats(VOID)
+{
+    printf("compressed_cache : stored %llu pages, rejected %llu, loaded %llu, wrote back %llu to the paging file\n",
+           compressed_pages_stored, compressed_pages_rejected, compressed_pages_loaded, compressed_pages_written_back);
+}
@@ -196,4 +196,105 @@ VOID print_va_access_rate(VOID)
     printf("Accessed PTEs: %llu\n", accessed_ptes);
     printf("Total PTEs: %llu\n", total_ptes);
     printf("Percent Accessed: %f\n", (double) accessed_ptes / total_ptes);
-}
\ No newline at end of file
+}
+
+// Finds the bucket a latency falls in, values below two sub bucket ranges get a bucket of their own
+// Above that, the top five bits of the value pick the bucket within its power of two
+ULONG64 fault_latency_bucket(ULONG64 duration)
+{
+    DWORD magnitude;
+
+    if (duration < FAULT_LATENCY_SUB_BUCKETS) {
+        return duration;
+    }
+
+    _BitScanReverse64(&magnitude, duration);
+    ULONG64 shift = magnitude - FAULT_LATENCY_SUB_BUCKET_BITS;
+
+    return ((shift + 1) << FAULT_LATENCY_SUB_BUCKET_BITS) + ((duration >> shift) - FAULT_LATENCY_SUB_BUCKETS);
+}
+
+// The smallest latency that lands in a bucket, the bucket ends where the next one starts
+ULONG64 fault_latency_bucket_start(ULONG64 bucket)
+{
+    if (bucket < FAULT_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    ULONG64 shift = (bucket >> FAULT_LATENCY_SUB_BUCKET_BITS) - 1;
+    return (FAULT_LATENCY_SUB_BUCKETS + (bucket & (FAULT_LATENCY_SUB_BUCKETS - 1))) << shift;
+}
+
+// Only the thread that owns the stats writes to them, so this needs no interlocked operations
+VOID record_fault_latency(PFAULT_STATS stats, ULONG type, ULONG64 start_time)
+{
+    PHDR_HISTOGRAM histogram = &stats->latencies[type];
+    ULONG64 duration = get_time_ns() - start_time;
+
+    histogram->buckets[fault_latency_bucket(duration)]++;
+    histogram->count++;
+    histogram->total += duration;
+    if (duration > histogram->max) {
+        histogram->max = duration;
+    }
+}
+
+// Sums every faulting thread's histograms into merged, which holds one histogram per fault type
+// Threads that are still faulting can be partway through a record, so the merge is only exact once they are done
+VOID merge_fault_latencies(PHDR_HISTOGRAM merged)
+{
+    memset(merged, 0, NUMBER_OF_FAULT_LATENCIES * sizeof(HDR_HISTOGRAM));
+
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        for (ULONG type = 0; type < NUMBER_OF_FAULT_LATENCIES; type++)
+        {
+            PHDR_HISTOGRAM histogram = &fault_stats[i].latencies[type];
+
+            merged[type].count += histogram->count;
+            merged[type].total += histogram->total;
+            merged[type].max = max(merged[type].max, histogram->max);
+            for (ULONG64 bucket = 0; bucket < FAULT_LATENCY_BUCKETS; bucket++)
+            {
+                merged[type].buckets[bucket] += histogram->buckets[bucket];
+            }
+        }
+    }
+}
+
+// Prints the count, mean, tail percentiles and max of each fault type across all faulting threads
+// Each percentile is the upper bound of the bucket it falls in
+VOID print_fault_latencies(VOID)
+{
+    static HDR_HISTOGRAM merged[NUMBER_OF_FAULT_LATENCIES];
+    char *names[NUMBER_OF_FAULT_LATENCIES] = {"demand zero faults", "soft faults", "hard faults", "fake faults", "page waits",
+                                              direct_io ? "direct I/O reads" : "mapped view reads"};
+    double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    merge_fault_latencies(merged);
+
+    for (ULONG type = 0; type < NUMBER_OF_FAULT_LATENCIES; type++)
+    {
+        PHDR_HISTOGRAM histogram = &merged[type];
+        ULONG64 running = 0;
+        ULONG64 next_percentile = 0;
+
+        printf("%-18s : %10llu", names[type], histogram->count);
+        if (histogram->count == 0) {
+            printf("\n");
+            continue;
+        }
+        printf(", mean %llu ns", histogram->total / histogram->count);
+
+        for (ULONG64 bucket = 0; bucket < FAULT_LATENCY_BUCKETS && next_percentile < ARRAYSIZE(percentiles); bucket++)
+        {
+            running += histogram->buckets[bucket];
+            while (next_percentile < ARRAYSIZE(percentiles) && running >= percentiles[next_percentile] * histogram->count)
+            {
+                printf(", p%g < %llu ns", percentiles[next_percentile] * 100.0, fault_latency_bucket_start(bucket + 1));
+                next_percentile++;
+            }
+        }
+        printf(", max %llu ns\n", histogram->max);
+    }
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <Windows.h>
+#include <nmmintrin.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+volatile ULONG64 *dedup_table;
+volatile LONG *slot_reference_counts;
+PULONG slot_buckets;
+
+// Counts the paging file writes we did not have to do because an identical page was already on the paging file
+volatile ULONG64 dedup_hits;
+
+// Hashes a page with the SSE4.2 CRC32 instruction
+// The page is split into four interleaved lanes so that the instruction's latency overlaps between them
+ULONG64 hash_page(PVOID page_va)
+{
+    PULONG64 words = (PULONG64) page_va;
+    ULONG64 lane0 = 0;
+    ULONG64 lane1 = 0x9E3779B9;
+    ULONG64 lane2 = 0x85EBCA6B;
+    ULONG64 lane3 = 0xC2B2AE35;
+
+    for (ULONG64 i = 0; i < PAGE_SIZE / sizeof(ULONG64); i += 4)
+    {
+        lane0 = _mm_crc32_u64(lane0, words[i]);
+        lane1 = _mm_crc32_u64(lane1, words[i + 1]);
+        lane2 = _mm_crc32_u64(lane2, words[i + 2]);
+        lane3 = _mm_crc32_u64(lane3, words[i + 3]);
+    }
+
+    return ((lane0 ^ (lane2 << 16)) << 32) | ((lane1 ^ (lane3 << 16)) & 0xFFFFFFFF);
+}
+
+ULONG64 dedup_bucket(ULONG64 hash)
+{
+    return hash & (DEDUP_TABLE_SIZE - 1);
+}
+
+ULONG64 dedup_entry(ULONG64 disc_index, ULONG64 hash)
+{
+    return (hash & ~DEDUP_SLOT_MASK) | (disc_index + 1);
+}
+
+// Takes a reference on a slot only if it still has an owner, a slot at zero is on its way back to the bitmap
+BOOLEAN try_reference_slot(ULONG64 disc_index)
+{
+    LONG count = slot_reference_counts[disc_index];
+
+    while (count > 0)
+    {
+        LONG old_count = InterlockedCompareExchange(&slot_reference_counts[disc_index], count + 1, count);
+        if (old_count == count) {
+            return TRUE;
+        }
+        count = old_count;
+    }
+
+    return FALSE;
+}
+
+// Looks for a slot on the paging file that already holds a copy of this page
+// Returns the slot with a reference taken for the caller, or DISC_INDEX_FAIL_CODE if there is none
+ULONG64 find_duplicate_slot(PVOID page_va, ULONG64 hash)
+{
+    UCHAR slot_contents[PAGE_SIZE];
+    ULONG64 bucket = dedup_bucket(hash);
+    ULONG64 entry = dedup_table[bucket];
+
+    if (entry == DEDUP_EMPTY_ENTRY || (entry & ~DEDUP_SLOT_MASK) != (hash & ~DEDUP_SLOT_MASK)) {
+        return DISC_INDEX_FAIL_CODE;
+    }
+
+    ULONG64 disc_index = (entry & DEDUP_SLOT_MASK) - 1;
+    if (try_reference_slot(disc_index) == FALSE) {
+        return DISC_INDEX_FAIL_CODE;
+    }
+
+    // The slot could have been freed and given to a new page between reading the entry and taking the reference
+    // Entries are removed before their slot is freed and only put back once the new contents are written
+    // So if the entry is still there, the slot holds what the entry describes
+    if (dedup_table[bucket] != entry)
+    {
+        free_disc_index(disc_index);
+        return DISC_INDEX_FAIL_CODE;
+    }
+
+    // Our reference keeps the slot's contents from changing, so this comparison settles hash collisions
+    read_from_pagefile(disc_index, slot_contents);
+    if (memcmp(slot_contents, page_va, PAGE_SIZE) != 0)
+    {
+        free_disc_index(disc_index);
+        return DISC_INDEX_FAIL_CODE;
+    }
+
+    InterlockedIncrement64((volatile LONG64 *) &dedup_hits);
+    return disc_index;
+}
+
+// Enters a slot into the table, this must only be done after its contents have been written
+VOID insert_dedup_slot(ULONG64 disc_index, ULONG64 hash)
+{
+    ULONG64 bucket = dedup_bucket(hash);
+
+    slot_buckets[disc_index] = (ULONG) bucket;
+    InterlockedExchange64((volatile LONG64 *) &dedup_table[bucket], (LONG64) dedup_entry(disc_index, hash));
+}
+
+// Every slot handed out by the allocator starts with its one owner
+VOID set_slot_reference(ULONG64 disc_index)
+{
+    InterlockedExchange(&slot_reference_counts[disc_index], 1);
+}
+
+// Drops one owner of a slot, returns TRUE if that was the last one and the slot can be freed
+BOOLEAN release_slot_reference(ULONG64 disc_index)
+{
+    LONG count = InterlockedDecrement(&slot_reference_counts[disc_index]);
+
+    if (count > 0) {
+        return FALSE;
+    }
+    if (count < 0) {
+        fatal_error("release_slot_reference : freed a disc slot that had no owner");
+    }
+
+    // The entry only comes out if it still names this slot, it may have been replaced by a newer page already
+    ULONG64 bucket = slot_buckets[disc_index];
+    ULONG64 entry = dedup_table[bucket];
+    if (entry != DEDUP_EMPTY_ENTRY && (entry & DEDUP_SLOT_MASK) == disc_index + 1)
+    {
+        InterlockedCompareExchange64((volatile LONG64 *) &dedup_table[bucket], DEDUP_EMPTY_ENTRY, (LONG64) entry);
+    }
+
+    return TRUE;
+}
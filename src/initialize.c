@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <userapp.h>
 #include <Windows.h>
+#include <winioctl.h>
 #include "../include/vm.h"
 #include "../include/debug.h"
 #include "../include/console.h"
@@ -25,19 +26,12 @@ HANDLE physical_page_handle;
 
 // These are handles to our events, which are used to signal between threads
 HANDLE wake_aging_event;
-HANDLE modified_writing_event;
-HANDLE pages_available_event;
 HANDLE disc_spot_available_event;
 HANDLE system_exit_event;
 HANDLE system_start_event;
 
 
 // These are the locks used in our system
-CRITICAL_SECTION modified_write_va_lock;
-CRITICAL_SECTION modified_read_va_lock;
-CRITICAL_SECTION repurpose_zero_va_lock;
-
-char pagefile_path[MAX_PATH];
 
 // These are page file handles
 //HANDLE page_file;
@@ -99,13 +93,12 @@ VOID get_privilege(VOID)
 VOID initialize_locks(VOID)
 {
     set_initialize_status("initialize_system", "setting up locks");
-    INITIALIZE_LOCK(modified_write_va_lock);
-    INITIALIZE_LOCK(modified_read_va_lock);
-    INITIALIZE_LOCK(repurpose_zero_va_lock);
 
     INITIALIZE_LOCK(free_page_list.lock);
     INITIALIZE_LOCK(standby_page_list.lock);
     INITIALIZE_LOCK(modified_page_list.lock);
+    INITIALIZE_LOCK(page_waiters_lock);
+    InitializeSRWLock(&vad_lock);
 }
 
 // This function is used to initialize all the events used in the system
@@ -116,21 +109,36 @@ VOID initialize_events(VOID)
     wake_aging_event = CreateEvent(NULL, FALSE, FALSE, NULL);
     NULL_CHECK(wake_aging_event, "initialize_events : could not initialize wake_aging_event")
 
-    modified_writing_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-    NULL_CHECK(modified_writing_event, "initialize_events : could not initialize modified_writing_event")
+    for (ULONG64 i = 0; i <= FOREGROUND_WRITER; i++)
+    {
+        modified_writers[i].wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        NULL_CHECK(modified_writers[i].wake_event, "initialize_events : could not initialize a modified writer's wake_event")
+
+        for (ULONG64 j = 0; j < MOD_WRITE_PIPELINE_DEPTH; j++)
+        {
+            modified_writers[i].batches[j].writes_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            NULL_CHECK(modified_writers[i].batches[j].writes_done_event,
+                       "initialize_events : could not initialize a modified write batch's writes_done_event")
+        }
+    }
+
+    scheduler_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    NULL_CHECK(scheduler_wake_event, "initialize_events : could not initialize scheduler_wake_event")
 
-    pages_available_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-    NULL_CHECK(pages_available_event, "initialize_events : could not initialize pages_available_event")
 
     disc_spot_available_event = CreateEvent(NULL, FALSE, FALSE, NULL);
     NULL_CHECK(disc_spot_available_event, "initialize_events : could not initialize disc_spot_available_event")
 
+
     // Notification Events
     system_exit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     NULL_CHECK(system_exit_event, "initialize_events : could not initialize system_exit_event")
 
     system_start_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     NULL_CHECK(system_start_event, "initialize_events : could not initialize system_start_event")
+
+    pagefile_exit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    NULL_CHECK(pagefile_exit_event, "initialize_events : could not initialize pagefile_exit_event")
 }
 
 // This function initializes all of our threads. Once they are initialized, they immediately start running.
@@ -143,7 +151,9 @@ VOID initialize_threads(VOID)
     faulting_thread_ids = (PULONG) malloc(NUMBER_OF_FAULTING_THREADS * sizeof(ULONG));
     NULL_CHECK(faulting_thread_ids, "initialize_threads : could not allocate memory for faulting_thread_ids")
 
-    fault_stats = (PFAULT_STATS) malloc(NUMBER_OF_FAULTING_THREADS * sizeof(FAULT_STATS));
+    // The stats are committed zeroed and page aligned, which also keeps each thread's stats on cache lines of their own
+    fault_stats = (PFAULT_STATS) VirtualAlloc(NULL, NUMBER_OF_FAULTING_THREADS * sizeof(FAULT_STATS),
+                                              MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
     NULL_CHECK(fault_stats, "initialize_threads : could not allocate memory for fault_stats")
 
     for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
@@ -153,15 +163,6 @@ VOID initialize_threads(VOID)
         NULL_CHECK(faulting_handles[i], "initialize_threads : could not initialize thread handle for faulting_thread")
     }
 
-    // Initialize faulting thread stat counters
-    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
-    {
-        fault_stats[i].num_faults = 0;
-        fault_stats[i].num_first_accesses = 0;
-        fault_stats[i].num_reaccesses = 0;
-        fault_stats[i].num_fake_faults = 0;
-    }
-
     system_handles = (PHANDLE) malloc(NUMBER_OF_SYSTEM_THREADS * sizeof(HANDLE));
     NULL_CHECK(system_handles, "initialize_threads : could not allocate memory for system_handles")
 
@@ -172,86 +173,173 @@ VOID initialize_threads(VOID)
     trim_thread,(LPVOID) (ULONG_PTR) 0, 0, &system_thread_ids[0]);
     NULL_CHECK(system_handles[0], "initialize_threads : could not initialize thread handle for trim_thread")
 
+    // Until the scheduler first runs, the trimmer keeps us above the low watermark and crossing it wakes the scheduler
+    trim_target = LOW_WATERMARK;
+    armed_watermark = LOW_WATERMARK;
+    dirty_limit = DIRTY_LIMIT_MAX;
+
     system_handles[1] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    modified_write_thread,(LPVOID) (ULONG_PTR) 1, 0, &system_thread_ids[1]);
-    NULL_CHECK(system_handles[1], "initialize_threads : could not initialize thread handle for modified_write_thread")
+    task_scheduling_thread,(LPVOID) (ULONG_PTR) 1, 0, &system_thread_ids[1]);
+    NULL_CHECK(system_handles[1], "initialize_threads : could not initialize thread handle for task_scheduling_thread")
 
-    system_handles[2] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    task_scheduling_thread,(LPVOID) (ULONG_PTR) 2, 0, &system_thread_ids[2]);
-    NULL_CHECK(system_handles[2], "initialize_threads : could not initialize thread handle for task_scheduling_thread")
+    for (ULONG64 i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        system_handles[2 + i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+        modified_write_thread,(LPVOID) &modified_writers[i], 0, &system_thread_ids[2 + i]);
+        NULL_CHECK(system_handles[2 + i], "initialize_threads : could not initialize thread handle for modified_write_thread")
+    }
+
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        pagefiles[i].write_thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+        pagefile_write_thread,(LPVOID) &pagefiles[i], 0, NULL);
+        NULL_CHECK(pagefiles[i].write_thread, "initialize_threads : could not initialize thread handle for pagefile_write_thread")
+    }
 }
 
 
-VOID initialize_pagefile_path()
+// Reads the page files to use from the command line, each one is given as --pagefile path[,weight]
+// A file's weight is its share of every batch the modified writer stripes across the files
+// Without any, we fall back to the one page file we have always used
+VOID parse_arguments(int argc, char **argv)
 {
-    char currentDirectory[MAX_PATH];
+    number_of_pagefiles = 0;
+    direct_io = FALSE;
 
-    // Get the current directory
-    if(!GetCurrentDirectory(MAX_PATH, currentDirectory)) {
-        printf("Failed to get current directory\n");
-        return;
-    }
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--direct-io") == 0)
+        {
+            direct_io = TRUE;
+            continue;
+        }
 
-    // Go back one directory
-    char* lastBackslash = strrchr(currentDirectory, '\\');
-    if (lastBackslash == NULL) {
-        printf("Failed to find last backslash\n");
-        return;
-    }
-    *lastBackslash = '\0';
+        if (strcmp(argv[i], "--persist") == 0 && i + 1 < argc)
+        {
+            i++;
+            snprintf(persist_path, MAX_PATH, "%s", argv[i]);
+            continue;
+        }
 
-    // Format the path to the pagefile
-    snprintf(pagefile_path, MAX_PATH, "%s", PAGEFILE_ABSOLUTE_PATH);
-}
+        // The modified writer tunes its batch size within these bounds
+        if (strcmp(argv[i], "--mod-batch") == 0 && i + 1 < argc)
+        {
+            i++;
+            char *end;
+            min_mod_batch_size = strtoull(argv[i], &end, 10);
+            max_mod_batch_size = *end == ',' ? strtoull(end + 1, NULL, 10) : min_mod_batch_size;
+            if (min_mod_batch_size == 0 || min_mod_batch_size > max_mod_batch_size || max_mod_batch_size > MAX_MOD_BATCH) {
+                fatal_error("parse_arguments : modified write batch bounds must be between 1 and MAX_MOD_BATCH");
+            }
+            mod_write_batch_size = max_mod_batch_size;
+            continue;
+        }
 
-VOID initialize_page_file() {
-    set_initialize_status("initialize_system", "configuring page file");
+        if (strcmp(argv[i], "--pagefile") != 0 || i + 1 == argc)
+        {
+            printf("parse_arguments : unrecognized argument %s\n", argv[i]);
+            printf("usage : vm [--direct-io] [--persist state_path] [--mod-batch min[,max]] [--pagefile path[,weight]]...\n");
+            fatal_error("parse_arguments : could not parse the command line");
+        }
 
-    initialize_pagefile_path();
+        if (number_of_pagefiles == MAX_PAGEFILES) {
+            fatal_error("parse_arguments : too many page files were given");
+        }
 
-    LARGE_INTEGER size;
-    size.QuadPart = PAGE_FILE_SIZE_IN_BYTES;
+        i++;
+        PPAGEFILE file = &pagefiles[number_of_pagefiles];
+        snprintf(file->path, MAX_PATH, "%s", argv[i]);
+        file->weight = 1;
 
-    pagefile_handle = CreateFileA(pagefile_path, GENERIC_READ | GENERIC_WRITE, 0,
-                                  NULL, CREATE_ALWAYS,
-                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        char *weight = strrchr(file->path, ',');
+        if (weight != NULL)
+        {
+            *weight = '\0';
+            file->weight = strtoull(weight + 1, NULL, 10);
+            if (file->weight == 0 || file->weight > MAX_PAGEFILE_WEIGHT) {
+                fatal_error("parse_arguments : page file weights must be between 1 and MAX_PAGEFILE_WEIGHT");
+            }
+        }
 
-    if (pagefile_handle == INVALID_HANDLE_VALUE) {
-        printf("pagefilePath: %s\n", pagefile_path);
-        fatal_error("Failed to open pagefile\n");
+        number_of_pagefiles++;
     }
 
-    // Set the file size
-    if (!SetFilePointerEx(pagefile_handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(pagefile_handle)) {
-        fatal_error("Failed to set file size\n");
+    if (number_of_pagefiles == 0)
+    {
+        snprintf(pagefiles[0].path, MAX_PATH, "%s", PAGEFILE_ABSOLUTE_PATH);
+        pagefiles[0].weight = 1;
+        number_of_pagefiles = 1;
     }
+}
+
+// The page files start out empty and sparse, their extents are added once the bitmap exists to hand out their slots
+// On a warm start they are opened as they were left, so the pages the saved state points to are still there
+VOID initialize_page_file() {
+    set_initialize_status("initialize_system", "configuring page files");
+
+    INITIALIZE_LOCK(pagefile_resize_lock);
+    INITIALIZE_LOCK(pagefile_stripe_lock);
 
-    HANDLE hMapFile = CreateFileMapping(
-        pagefile_handle,
-        NULL,
-        PAGE_READWRITE,
-        size.HighPart,
-        size.LowPart,
-        NULL
-    );
-
-    if (hMapFile == NULL) {
-        fatal_error("Failed to create file mapping\n");
+    // Direct I/O skips the OS page cache and writes through to the disc
+    // The handle is overlapped so that faulting threads and the write threads can all have I/O in flight on it
+    DWORD flags = FILE_ATTRIBUTE_NORMAL;
+    if (direct_io) {
+        flags |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED;
     }
 
-    page_file = MapViewOfFile(
-        hMapFile,
-        FILE_MAP_ALL_ACCESS,
-        0,
-        0,
-        PAGE_FILE_SIZE_IN_BYTES
-    );
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        PPAGEFILE file = &pagefiles[i];
+
+        file->handle = CreateFileA(file->path, GENERIC_READ | GENERIC_WRITE, 0,
+                                   NULL, warm_start ? OPEN_EXISTING : CREATE_ALWAYS,
+                                   flags, NULL);
+
+        if (file->handle == INVALID_HANDLE_VALUE) {
+            printf("pagefilePath: %s\n", file->path);
+            fatal_error("Failed to open pagefile\n");
+        }
 
-    if (page_file == NULL) {
-        fatal_error("Failed to map view of file\n");
+        // A sparse file only takes up disc space where it has been written
+        // File systems without sparse files still work, they just allocate each extent as the file grows
+        // An overlapped handle has to be given an OVERLAPPED for this, a synchronous one just finishes before returning
+        DWORD bytes_returned;
+        OVERLAPPED overlapped = {0};
+        overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        NULL_CHECK(overlapped.hEvent, "initialize_page_file : could not create event for FSCTL_SET_SPARSE")
+
+        if (!DeviceIoControl(file->handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes_returned, &overlapped) &&
+            (GetLastError() != ERROR_IO_PENDING ||
+             !GetOverlappedResult(file->handle, &overlapped, &bytes_returned, TRUE))) {
+            printf("initialize_page_file : could not make %s sparse %lu\n", file->path, GetLastError());
+        }
+        CloseHandle(overlapped.hEvent);
+
+        file->stripe_credit = 0;
+        file->last_checked_index = (LONG64) (i * PAGES_PER_PAGEFILE);
+        file->active_extents = 0;
+        for (ULONG64 extent = 0; extent < EXTENTS_PER_PAGEFILE; extent++)
+        {
+            file->extent_views[extent] = NULL;
+        }
+
+        INITIALIZE_LOCK(file->write_queue_lock);
+        file->write_queue.Flink = file->write_queue.Blink = &file->write_queue;
+        file->write_queued_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        NULL_CHECK(file->write_queued_event, "initialize_page_file : could not initialize write_queued_event")
     }
+}
+
+// Allocates both levels of a summary bitmap, chunks are marked in it as their extents are put in use
+VOID initialize_summary_bitmap(PSUMMARY_BITMAP summary)
+{
+    summary->level1 = malloc(SUMMARY_LEVEL1_SIZE_IN_CHUNKS * BITMAP_CHUNK_SIZE);
+    NULL_CHECK(summary->level1, "initialize_summary_bitmap : could not allocate memory for level one")
+    memset(summary->level1, 0, SUMMARY_LEVEL1_SIZE_IN_CHUNKS * BITMAP_CHUNK_SIZE);
 
-    CloseHandle(hMapFile);
+    summary->level2 = malloc(SUMMARY_LEVEL2_SIZE_IN_CHUNKS * BITMAP_CHUNK_SIZE);
+    NULL_CHECK(summary->level2, "initialize_summary_bitmap : could not allocate memory for level two")
+    memset(summary->level2, 0, SUMMARY_LEVEL2_SIZE_IN_CHUNKS * BITMAP_CHUNK_SIZE);
 }
 
 VOID initialize_page_file_bitmap(VOID)
@@ -266,18 +354,91 @@ VOID initialize_page_file_bitmap(VOID)
     // Initialize the bitmap
     page_file_bitmap = malloc(BITMAP_SIZE_IN_BYTES);
     NULL_CHECK(page_file_bitmap, "malloc failed to allocate memory for the page file bitmap");
-    memset(page_file_bitmap, 0, BITMAP_SIZE_IN_BYTES);
     page_file_bitmap_end = page_file_bitmap + BITMAP_SIZE_IN_BYTES / sizeof (*page_file_bitmap);
 
-    free_disc_spot_count = BITMAP_SIZE_IN_BITS;
+    // Every slot starts out used, and only the slots of the extents we put in use are freed
+    memset(page_file_bitmap, 0xFF, BITMAP_SIZE_IN_BYTES);
+    free_disc_spot_count = 0;
+
+    initialize_summary_bitmap(&free_chunk_summary);
+    initialize_summary_bitmap(&empty_chunk_summary);
+
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        for (ULONG64 extent = 0; extent < INITIAL_PAGEFILE_EXTENTS; extent++)
+        {
+            activate_pagefile_extent(i, extent);
+        }
+    }
+
+    // Initialize the freed slot magazines, VirtualAlloc gives us the alignment that the lock free lists need
+    freed_slot_magazines = VirtualAlloc(NULL, NUMBER_OF_FREED_SLOT_MAGAZINES * sizeof(FREED_SLOT_MAGAZINE),
+                                        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    NULL_CHECK(freed_slot_magazines, "initialize_page_file_bitmap : could not allocate memory for the freed slot magazines")
 
-    // Initialize the freed spaces array
-    freed_spaces = (PULONG64) malloc(MAX_FREED_SPACES_SIZE * sizeof(ULONG64));
-    NULL_CHECK(freed_spaces, "malloc failed to allocate memory for the freed spaces array");
-    freed_spaces_size = 0;
+    InitializeSListHead(&full_magazines);
+    InitializeSListHead(&empty_magazines);
+    full_magazine_count = 0;
+
+    for (ULONG64 i = 0; i < NUMBER_OF_FREED_SLOT_MAGAZINES; i++)
+    {
+        freed_slot_magazines[i].count = 0;
+        InterlockedPushEntrySList(&empty_magazines, &freed_slot_magazines[i].entry);
+    }
 
 }
 
+#if COMPRESSED_CACHE
+// Sets up the arena that compressed pages are stored in, along with the entries that describe them
+VOID initialize_compressed_cache(VOID)
+{
+    set_initialize_status("initialize_system", "creating compressed page cache");
+
+    INITIALIZE_LOCK(compressed_cache_lock);
+
+    compressed_arena = VirtualAlloc(NULL, COMPRESSED_CACHE_SIZE_IN_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    NULL_CHECK(compressed_arena, "initialize_compressed_cache : could not allocate memory for the compressed arena")
+    compressed_arena_used = 0;
+
+    for (ULONG64 i = 0; i < NUMBER_OF_SIZE_CLASSES; i++)
+    {
+        compressed_block_free_lists[i] = NULL;
+    }
+
+    compressed_entries = malloc(MAX_COMPRESSED_ENTRIES * sizeof(COMPRESSED_ENTRY));
+    NULL_CHECK(compressed_entries, "initialize_compressed_cache : could not allocate memory for compressed entries")
+    memset(compressed_entries, 0, MAX_COMPRESSED_ENTRIES * sizeof(COMPRESSED_ENTRY));
+
+    compressed_entry_free_list.Flink = compressed_entry_free_list.Blink = &compressed_entry_free_list;
+    compressed_lru.Flink = compressed_lru.Blink = &compressed_lru;
+
+    for (ULONG64 i = 0; i < MAX_COMPRESSED_ENTRIES; i++)
+    {
+        insert_tail_list(&compressed_entry_free_list, &compressed_entries[i].entry);
+    }
+}
+#endif
+
+#if PAGEFILE_DEDUP
+// Sets up the slot index table along with the per slot reference counts that let pages share slots
+VOID initialize_dedup(VOID)
+{
+    set_initialize_status("initialize_system", "creating page file dedup table");
+
+    dedup_table = malloc(DEDUP_TABLE_SIZE * sizeof(ULONG64));
+    NULL_CHECK(dedup_table, "initialize_dedup : could not allocate memory for the dedup table")
+    memset((PVOID) dedup_table, 0, DEDUP_TABLE_SIZE * sizeof(ULONG64));
+
+    slot_reference_counts = malloc(BITMAP_SIZE_IN_BITS * sizeof(LONG));
+    NULL_CHECK(slot_reference_counts, "initialize_dedup : could not allocate memory for slot reference counts")
+    memset((PVOID) slot_reference_counts, 0, BITMAP_SIZE_IN_BITS * sizeof(LONG));
+
+    slot_buckets = malloc(BITMAP_SIZE_IN_BITS * sizeof(ULONG));
+    NULL_CHECK(slot_buckets, "initialize_dedup : could not allocate memory for slot buckets")
+    memset(slot_buckets, 0, BITMAP_SIZE_IN_BITS * sizeof(ULONG));
+}
+#endif
+
 // This function initializes our page lists
 VOID initialize_page_lists(VOID)
 {
@@ -292,6 +453,9 @@ VOID initialize_page_lists(VOID)
     initialize_listhead(&standby_page_list);
     standby_page_list.num_pages = 0;
 
+    page_waiters.Flink = page_waiters.Blink = &page_waiters;
+    num_page_waiters = 0;
+
 }
 
 // This initializes va space for our system to map pages into
@@ -301,18 +465,33 @@ VOID initialize_system_va_space(VOID)
 {
     set_initialize_status("initialize_system", "setting up system VAs");
 
-    // TODO MAKE THIS A GLOBAL CONSTANT
-    modified_write_va = VirtualAlloc(NULL,PAGE_SIZE * 256,MEM_RESERVE | MEM_PHYSICAL,
-                                     PAGE_READWRITE);
-    NULL_CHECK(modified_write_va, "initialize_system_va_space : could not reserve memory for modified write va")
+    for (ULONG64 i = 0; i <= FOREGROUND_WRITER; i++)
+    {
+        // Each batch in a writer's pipeline is mapped into its own window, so one can be mapped while another is written
+        for (ULONG64 j = 0; j < MOD_WRITE_PIPELINE_DEPTH; j++)
+        {
+            modified_writers[i].batches[j].write_va = VirtualAlloc(NULL,PAGE_SIZE * MAX_MOD_BATCH,
+                                                                   MEM_RESERVE | MEM_PHYSICAL, PAGE_READWRITE);
+            NULL_CHECK(modified_writers[i].batches[j].write_va,
+                       "initialize_system_va_space : could not reserve memory for modified write va")
+        }
+    }
+
+    // VirtualAlloc gives us the alignment that the lock free list needs
+    page_windows = VirtualAlloc(NULL, NUMBER_OF_PAGE_WINDOWS * sizeof(PAGE_WINDOW), MEM_RESERVE | MEM_COMMIT,
+                                PAGE_READWRITE);
+    NULL_CHECK(page_windows, "initialize_system_va_space : could not allocate memory for the page windows")
 
-    modified_read_va = VirtualAlloc(NULL,PAGE_SIZE,MEM_RESERVE | MEM_PHYSICAL,
-                                    PAGE_READWRITE);
-    NULL_CHECK(modified_read_va, "initialize_system_va_space : could not reserve memory for modified read va")
+    InitializeSListHead(&free_page_windows);
 
-    repurpose_zero_va = VirtualAlloc(NULL,PAGE_SIZE,MEM_RESERVE | MEM_PHYSICAL,
-                                    PAGE_READWRITE);
-    NULL_CHECK(repurpose_zero_va, "initialize_system_va_space : could not reserve memory for repurpose zero va")
+    for (ULONG64 i = 0; i < NUMBER_OF_PAGE_WINDOWS; i++)
+    {
+        page_windows[i].va = VirtualAlloc(NULL,PAGE_SIZE,MEM_RESERVE | MEM_PHYSICAL,
+                                          PAGE_READWRITE);
+        NULL_CHECK(page_windows[i].va, "initialize_system_va_space : could not reserve memory for a page window")
+
+        InterlockedPushEntrySList(&free_page_windows, &page_windows[i].entry);
+    }
 }
 
 // This function initializes our virtual address space
@@ -437,6 +616,7 @@ VOID initialize_pfn_metadata(VOID)
         memset(pfn_base + physical_page_numbers[i], 0, sizeof(PFN));
         pfn = pfn_from_frame_number(frame_number);
         pfn->flags.state = FREE;
+        pfn->disc_index = NO_DISC_INDEX;
         // This should be done in initialize_locks, but this is an intermediary method of locking PFNs
         // So it is pointless to move
         INITIALIZE_LOCK(pfn->lock);
@@ -535,6 +715,9 @@ VOID initialize_system (VOID) {
 
     physical_page_handle = GetCurrentProcess();
 
+    // Everything that is timed from here on reads the same clock
+    initialize_timing();
+
     initialize_locks();
 
     initialize_events();
@@ -545,25 +728,51 @@ VOID initialize_system (VOID) {
 
     initialize_pfn_metadata();
 
+    // The size of the address space has to be known to tell whether a saved state fits it
+    initialize_user_va_space();
+
+    read_persisted_state();
+
     initialize_page_file();
 
     initialize_page_file_bitmap();
 
-    initialize_user_va_space();
+#if PAGEFILE_DEDUP
+    initialize_dedup();
+#endif
+
+#if COMPRESSED_CACHE
+    initialize_compressed_cache();
+#endif
 
     initialize_system_va_space();
 
     initialize_pte_metadata();
 
+    load_persisted_state();
+
     set_initialize_status("initialize_system", "system successfully initialized, running tests");
 
     initialize_threads();
 }
 
 VOID delete_pagefile() {
-    UnmapViewOfFile(page_file);
-    CloseHandle(pagefile_handle);
-    DeleteFileA(pagefile_path);
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        PPAGEFILE file = &pagefiles[i];
+
+        for (ULONG64 extent = 0; extent < EXTENTS_PER_PAGEFILE; extent++)
+        {
+            if (file->extent_views[extent] != NULL) {
+                UnmapViewOfFile(file->extent_views[extent]);
+            }
+        }
+        CloseHandle(file->handle);
+        // The saved state points into the page files, so they are kept for the next run
+        if (state_persisted == FALSE) {
+            DeleteFileA(file->path);
+        }
+    }
 }
 
 // Terminates the program and gives all resources back to the operating system
@@ -571,17 +780,75 @@ VOID deinitialize_system (VOID)
 {
     set_initialize_status("deinitialize_system", "Tests finished, deinitializing system");
 
+    // Saving the state writes pages out, which needs the system threads, so it happens before they are told to exit
+    save_persisted_state();
+
     // We need to close all system threads and wait for them to exit before proceeding
     // This happens so that no thread tries to access a data structure that we have freed
     SetEvent(system_exit_event);
-    WaitForMultipleObjects(NUMBER_OF_FAULTING_THREADS, system_handles, TRUE, INFINITE);
+    WaitForMultipleObjects(NUMBER_OF_SYSTEM_THREADS, system_handles, TRUE, INFINITE);
+
+    // The page file I/O threads go last, as a modified writer that is exiting can still be waiting on their writes
+    SetEvent(pagefile_exit_event);
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        WaitForSingleObject(pagefiles[i].write_thread, INFINITE);
+        CloseHandle(pagefiles[i].write_thread);
+    }
+    CloseHandle(pagefile_exit_event);
 
     // Now that we're done with our memory, we are able to free it
     free(pte_base);
-    VirtualFree(modified_read_va, PAGE_SIZE, MEM_RELEASE);
-    VirtualFree(modified_write_va, PAGE_SIZE, MEM_RELEASE);
+    for (ULONG64 i = 0; i < NUMBER_OF_PAGE_WINDOWS; i++)
+    {
+        VirtualFree(page_windows[i].va, 0, MEM_RELEASE);
+    }
+    VirtualFree(page_windows, 0, MEM_RELEASE);
+    for (ULONG64 i = 0; i <= FOREGROUND_WRITER; i++)
+    {
+        for (ULONG64 j = 0; j < MOD_WRITE_PIPELINE_DEPTH; j++)
+        {
+            VirtualFree(modified_writers[i].batches[j].write_va, 0, MEM_RELEASE);
+            CloseHandle(modified_writers[i].batches[j].writes_done_event);
+        }
+        CloseHandle(modified_writers[i].wake_event);
+    }
+    free_vad_tree(vad_root);
     VirtualFree(va_base, virtual_address_size, MEM_RELEASE);
     free(page_file_bitmap);
+    free(free_chunk_summary.level1);
+    free(free_chunk_summary.level2);
+    free(empty_chunk_summary.level1);
+    free(empty_chunk_summary.level2);
+    VirtualFree(freed_slot_magazines, 0, MEM_RELEASE);
+    printf("page fault handler : %llu faults waited on a read that was already in progress\n", read_collisions);
+    printf("page fault handler : %llu pages were prefaulted ahead of their accesses\n", prefaulted_pages);
+    printf("vad : %llu pages were given back without being written\n", vad_pages_released);
+    printf("page fault handler : %llu direct reclaims trimmed %llu pages\n", direct_reclaims, direct_reclaim_pages);
+    printf("trimmer : skipped %llu paging file writes of clean pages\n", clean_pages_trimmed);
+    printf("scheduler : paced dirtying threads %llu times for %llu ms in total\n", dirty_throttles, dirty_throttle_ms);
+    printf("scheduler : consumed %.1f pages per ms, one modified writer wrote %.1f pages per ms\n",
+           consumption_rate, write_rate);
+    printf("modified writer : %llu of %llu VA adjacent page writes went to adjacent disc slots (%.1f%%)\n",
+           va_contiguous_writes, va_adjacent_writes,
+           va_adjacent_writes == 0 ? 0.0 : 100.0 * (double) va_contiguous_writes / (double) va_adjacent_writes);
+    printf("modified writer : batch size %llu pages, averaged %llu pages over %llu batches within [%llu, %llu]\n",
+           mod_write_batch_size, mod_write_batch_size_total / max(mod_write_batches_sized, 1), mod_write_batches_sized,
+           min_mod_batch_size, max_mod_batch_size);
+#if ZERO_PAGE_DETECTION
+    printf("modified writer : skipped %llu paging file writes of zero pages\n", zero_pages_skipped);
+#endif
+#if PAGEFILE_DEDUP
+    printf("modified writer : skipped %llu paging file writes of duplicate pages\n", dedup_hits);
+    free((PVOID) dedup_table);
+    free((PVOID) slot_reference_counts);
+    free(slot_buckets);
+#endif
+#if COMPRESSED_CACHE
+    print_compressed_cache_stats();
+    VirtualFree(compressed_arena, 0, MEM_RELEASE);
+    free(compressed_entries);
+#endif
     delete_pagefile();
 
     VirtualFree(pfn_base, physical_page_numbers[physical_page_count - 1] * sizeof(PFN),
@@ -594,7 +861,7 @@ VOID deinitialize_system (VOID)
     // Free the thread handles and thread id arrays
     free(faulting_handles);
     free(faulting_thread_ids);
-    free(fault_stats);
+    VirtualFree(fault_stats, 0, MEM_RELEASE);
     free(system_handles);
     free(system_thread_ids);
 
@@ -1,22 +1,226 @@
 #include <stdio.h>
 #include <Windows.h>
+#include <emmintrin.h>
 #include "../include/vm.h"
 #include "../include/debug.h"
 
+// Marks a page in a batch that was found to be all zeroes, it needs neither a disc slot nor a write
+#define ZERO_PAGE_DISC_INDEX            (DISC_INDEX_FAIL_CODE - 1)
+
+// Counts the paging file writes we did not have to do because the page was all zeroes
+volatile ULONG64 zero_pages_skipped;
+
+MODIFIED_WRITER modified_writers[NUMBER_OF_MODIFIED_WRITERS + 1];
+// Only the first active_modified_writers writers are woken by the scheduler, the rest sleep until it needs them
+volatile ULONG64 active_modified_writers = 1;
+
+// The number of pages each batch asks for, tuned after every batch that was given all of them
+volatile ULONG64 mod_write_batch_size = MAX_MOD_BATCH;
+// The bounds the batch size is kept within, these can be narrowed with --mod-batch min,max
+ULONG64 min_mod_batch_size = MIN_MOD_BATCH;
+ULONG64 max_mod_batch_size = MAX_MOD_BATCH;
+// Written pages whose VA neighbour was written just before them in the same batch,
+// And how many of those went to the slot right after their neighbour's, so a read of one could bring in both
+volatile ULONG64 va_adjacent_writes;
+volatile ULONG64 va_contiguous_writes;
+// Together these give the average batch size that was asked for
+volatile ULONG64 mod_write_batches_sized;
+volatile ULONG64 mod_write_batch_size_total;
+// A moving average of how many pages per microsecond (in 1024ths) full batches have been written at
+ULONG64 mod_write_throughput_average;
+
+// Checks a page 64 bytes at a time with SSE2, ORing four 16 byte loads together before each compare
+// Most non zero pages have data near their start, so we stop at the first block that is not zero
+BOOLEAN is_page_zero(PVOID page_va)
+{
+    __m128i *block = (__m128i *) page_va;
+    __m128i *end = (__m128i *) ((ULONG_PTR) page_va + PAGE_SIZE);
+    __m128i zero = _mm_setzero_si128();
+
+    while (block < end)
+    {
+        __m128i combined = _mm_or_si128(_mm_or_si128(_mm_load_si128(block), _mm_load_si128(block + 1)),
+                                        _mm_or_si128(_mm_load_si128(block + 2), _mm_load_si128(block + 3)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(combined, zero)) != 0xFFFF) {
+            return FALSE;
+        }
+        block += 4;
+    }
+
+    return TRUE;
+}
+
+
+// Tunes the batch size from a batch that was given every page it asked for
+// A batch that was too slow halves the size, as small batches are what keep the writer's hold on pages short
+// A batch written slower per page than the ones before it takes a step back, as the bigger size did not pay for itself
+// Otherwise the size grows a step while there is a backlog, so that fewer, bigger writes cover the per I/O overhead
+// Any number of writers can run this at once, but a lost update only costs one step
+VOID adjust_mod_write_batch_size(ULONG64 num_pages, ULONG64 latency_us)
+{
+    ULONG64 size = mod_write_batch_size;
+    ULONG64 throughput = (num_pages << 10) / max(latency_us, 1);
+    ULONG64 average = mod_write_throughput_average;
+
+    if (latency_us > MOD_BATCH_TARGET_LATENCY_US) {
+        size = size / 2;
+    }
+    else if (average != 0 && throughput < average - average / 8) {
+        size = size > MOD_BATCH_STEP ? size - MOD_BATCH_STEP : 0;
+    }
+    else if (modified_page_list.num_pages >= size * MOD_BATCH_BACKLOG) {
+        size = size + MOD_BATCH_STEP;
+    }
+
+    mod_write_throughput_average = average == 0 ? throughput : (average * 7 + throughput) / 8;
+    mod_write_batch_size = max(min_mod_batch_size, min(size, max_mod_batch_size));
+}
+
+// Orders a batch by PTE address, so pages next to each other in the VA space are next to each other in the batch
+// And are given consecutive disc slots. The trimmer walks PTEs in order, so a batch is mostly sorted runs already
+// Which is what insertion sort is quickest on
+VOID sort_batch_by_va(PMOD_WRITE_BATCH batch)
+{
+    for (ULONG64 i = 1; i < batch->num_pages; i++)
+    {
+        PPTE pte = batch->ptes[i];
+        ULONG_PTR frame_number = batch->frame_numbers[i];
+        ULONG64 j = i;
+
+        while (j > 0 && batch->ptes[j - 1] > pte)
+        {
+            batch->ptes[j] = batch->ptes[j - 1];
+            batch->frame_numbers[j] = batch->frame_numbers[j - 1];
+            j--;
+        }
+
+        batch->ptes[j] = pte;
+        batch->frame_numbers[j] = frame_number;
+    }
+}
+
+// Counts how much of a batch's VA contiguity made it onto the paging file
+VOID track_va_contiguity(PMOD_WRITE_BATCH batch)
+{
+    ULONG64 adjacent = 0;
+    ULONG64 contiguous = 0;
+
+    for (ULONG64 i = 1; i < batch->num_pages; i++)
+    {
+        if (batch->needs_write[i] == FALSE || batch->needs_write[i - 1] == FALSE ||
+            batch->ptes[i] != batch->ptes[i - 1] + 1) {
+            continue;
+        }
+
+        adjacent++;
+        if (batch->disc_indices[i] == batch->disc_indices[i - 1] + 1 &&
+            PAGEFILE_FROM_DISC_INDEX(batch->disc_indices[i]) == PAGEFILE_FROM_DISC_INDEX(batch->disc_indices[i - 1])) {
+            contiguous++;
+        }
+    }
 
-BOOLEAN write_pages_to_disc(VOID)
+    InterlockedAdd64((volatile LONG64 *) &va_adjacent_writes, (LONG64) adjacent);
+    InterlockedAdd64((volatile LONG64 *) &va_contiguous_writes, (LONG64) contiguous);
+}
+
+// This gives the pages in a batch that are still without a home a disc index each, as runs of contiguous slots
+// Pages given a slot here are marked in needs_write. Returns the number of pages that got one
+ULONG64 assign_disc_slots(PULONG64 disc_indices, PBOOLEAN needs_write, ULONG64 num_pages, ULONG64 num_needed)
+{
+    DISC_RUN disc_runs[MAX_MOD_BATCH];
+    ULONG64 num_disc_runs = 0;
+    ULONG64 num_returned_indices = 0;
+
+    // Each stripe comes from the next page file in turn, so a batch is spread across all of them by their weights
+    while (num_returned_indices < num_needed)
+    {
+        ULONG64 num_stripe_runs;
+        ULONG64 stripe = min(num_needed - num_returned_indices, PAGEFILE_STRIPE_SIZE);
+        ULONG64 num_stripe_indices = get_disc_runs(disc_runs + num_disc_runs, &num_stripe_runs, stripe);
+
+        if (num_stripe_indices == 0) {
+            break;
+        }
+        num_returned_indices += num_stripe_indices;
+        num_disc_runs += num_stripe_runs;
+    }
+
+    ULONG64 run = 0;
+    ULONG64 offset_in_run = 0;
+    for (ULONG64 i = 0; i < num_pages && run < num_disc_runs; i++)
+    {
+        if (disc_indices[i] != DISC_INDEX_FAIL_CODE) {
+            continue;
+        }
+
+        disc_indices[i] = disc_runs[run].start + offset_in_run;
+        needs_write[i] = TRUE;
+        offset_in_run++;
+        if (offset_in_run == disc_runs[run].length)
+        {
+            run++;
+            offset_in_run = 0;
+        }
+    }
+
+    return num_returned_indices;
+}
+
+// Pages that sit next to each other in our private VA space and were given consecutive disc slots on the same file
+// Are copied to the paging file together. Each page file's writes go to its own I/O thread
+// This only queues the writes, the batch's event is set once all of them are on disc
+VOID write_batch_to_pagefile(PMOD_WRITE_BATCH batch)
+{
+    ULONG64 num_writes = 0;
+    ULONG64 i = 0;
+
+    while (i < batch->num_pages)
+    {
+        if (batch->needs_write[i] == FALSE)
+        {
+            i++;
+            continue;
+        }
+
+        ULONG64 run_length = 1;
+        while (i + run_length < batch->num_pages && batch->needs_write[i + run_length] &&
+               batch->disc_indices[i + run_length] == batch->disc_indices[i] + run_length &&
+               PAGEFILE_FROM_DISC_INDEX(batch->disc_indices[i + run_length]) == PAGEFILE_FROM_DISC_INDEX(batch->disc_indices[i]))
+        {
+            run_length++;
+        }
+
+        batch->writes[num_writes].disc_index = batch->disc_indices[i];
+        batch->writes[num_writes].src_va = (PVOID) ((ULONG_PTR) batch->write_va + i * PAGE_SIZE);
+        batch->writes[num_writes].num_pages = run_length;
+        num_writes++;
+
+        i += run_length;
+    }
+
+    queue_pagefile_writes(batch->writes, num_writes, &batch->pending_writes, &batch->writes_done_time,
+                          batch->writes_done_event);
+}
+
+// The first half of writing a batch: pops it off the modified list, maps it into the batch's window,
+// Decides what each page needs and queues the writes. Returns FALSE if there was nothing to pop
+BOOLEAN start_mod_write_batch(PMOD_WRITE_BATCH batch)
 {
     ULONG64 target_pages;
     PFN_LIST batch_list;
     PPFN pfn;
-    PFN local;
 
-    ULONG64 start_time = GetTickCount64();
+    batch->start_time = get_time_ns();
 
     // Find the target number of pages to write
-    target_pages = MAX_MOD_BATCH;
+#if ADAPTIVE_MOD_BATCH
+    target_pages = mod_write_batch_size;
+#else
+    target_pages = max_mod_batch_size;
+#endif
+    batch->target_pages = target_pages;
 
-    // There is no reason to get more pages than we have disc indices
     // This check is done without locks, so it is not perfectly accurate
     // Still, it will give us a good enough heuristic of our supply of modified pages
     if (modified_page_list.num_pages < target_pages)
@@ -24,130 +228,300 @@ BOOLEAN write_pages_to_disc(VOID)
         target_pages = modified_page_list.num_pages;
     }
 
-    // Get as many disc indices as we can
-    ULONG64 disc_indices[MAX_MOD_BATCH];
-    ULONG num_returned_indices = get_disc_indices(disc_indices, target_pages);
-    if (num_returned_indices == 0)
+#if COMPRESSED_CACHE == 0
+    // Without the compressed cache there is no reason to get more pages than we have disc indices
+    if ((ULONG64) free_disc_spot_count < target_pages)
     {
-        return FALSE;
+        target_pages = (ULONG64) free_disc_spot_count;
     }
+#endif
 
-    // Bound the number of pages to pull off the modified list by the number of disc indices we have
-    target_pages = num_returned_indices;
-
-    // Initialize the list of pages to write to disc
-    initialize_listhead(&batch_list);
-    batch_list.num_pages = 0;
-
-    // Lock the list of modified pages
-    EnterCriticalSection(&modified_page_list.lock);
-
-    // Check the count of the list. If the list is empty, we can return after freeing the disc indices
-    if (modified_page_list.num_pages == 0)
+    if (target_pages == 0)
     {
-        LeaveCriticalSection(&modified_page_list.lock);
-        free_disc_indices(disc_indices, num_returned_indices, 0);
         return FALSE;
     }
 
+    // Lock the list of modified pages
+    EnterCriticalSection(&modified_page_list.lock);
+
     // Pop the modified pages
     batch_pop_from_list_head(&modified_page_list, &batch_list, target_pages, TRUE);
     LeaveCriticalSection(&modified_page_list.lock);
 
     target_pages = batch_list.num_pages;
+    batch->num_pages = target_pages;
 
-    if (batch_list.num_pages == 0)
+    if (target_pages == 0)
     {
-        free_disc_indices(disc_indices, num_returned_indices, 0);
         return FALSE;
     }
 
     // Find the frame numbers associated with the PFNs
-    ULONG64 frame_numbers[MAX_MOD_BATCH];
+    // From here on the batch list is only walked through this array, as every page is finished on its own
     PLIST_ENTRY entry = batch_list.entry.Flink;
     for (ULONG64 i = 0; i < target_pages; i++)
     {
         pfn = CONTAINING_RECORD(entry, PFN, entry);
-        frame_numbers[i] = frame_number_from_pfn(pfn);
+        batch->frame_numbers[i] = frame_number_from_pfn(pfn);
+        batch->ptes[i] = pfn->pte;
+        batch->disc_indices[i] = DISC_INDEX_FAIL_CODE;
+        batch->needs_write[i] = FALSE;
         entry = entry->Flink;
     }
 
-    // Free any extra disc indices
-    if (batch_list.num_pages < num_returned_indices)
+#if VA_CLUSTERED_WRITES
+    // This has to happen before the batch is mapped, as the window is laid out in batch order
+    sort_batch_by_va(batch);
+#endif
+
+    // Map the pages to our private VA space
+    map_pages(batch->write_va, target_pages, batch->frame_numbers);
+
+    // Pages that are all zeroes or compress well stay in memory and never need a disc slot
+    // Pages identical to one already on the paging file share its slot and need no write
+    batch->num_needing_slots = target_pages;
+    batch->num_zero_pages = 0;
+    for (ULONG64 i = 0; i < target_pages; i++)
     {
-        free_disc_indices(disc_indices, num_returned_indices, batch_list.num_pages);
+        PVOID page_va = (PVOID) ((ULONG_PTR) batch->write_va + i * PAGE_SIZE);
+
+#if ZERO_PAGE_DETECTION
+        if (is_page_zero(page_va)) {
+            batch->disc_indices[i] = ZERO_PAGE_DISC_INDEX;
+            batch->num_needing_slots--;
+            batch->num_zero_pages++;
+            continue;
+        }
+#endif
+
+#if PAGEFILE_DEDUP
+        batch->hashes[i] = hash_page(page_va);
+        batch->disc_indices[i] = find_duplicate_slot(page_va, batch->hashes[i]);
+        if (batch->disc_indices[i] != DISC_INDEX_FAIL_CODE) {
+            batch->num_needing_slots--;
+            continue;
+        }
+#endif
+
+#if COMPRESSED_CACHE
+        batch->disc_indices[i] = store_compressed_page(page_va, batch->ptes[i]);
+        if (batch->disc_indices[i] != DISC_INDEX_FAIL_CODE) {
+            batch->num_needing_slots--;
+        }
+#else
+        UNREFERENCED_PARAMETER(page_va);
+#endif
     }
 
-    // Map the pages to our private VA space
-    map_pages(modified_write_va, target_pages, frame_numbers);
+    // The page file grows here rather than in the allocator, so that no thread faulting a page in waits on it
+    if (batch->num_needing_slots != 0) {
+        grow_page_file();
+    }
+
+    batch->num_slotted = assign_disc_slots(batch->disc_indices, batch->needs_write, target_pages, batch->num_needing_slots);
+    track_va_contiguity(batch);
 
-    // For each page, copy the contents to the paging file according to its corresponding disc index
+    write_batch_to_pagefile(batch);
+    return TRUE;
+}
+
+// The second half of writing a batch: waits for its writes, unmaps it and moves every page to where it now belongs
+// Returns FALSE if no page in the batch found a home, which means there is no point in starting another one
+BOOLEAN finish_mod_write_batch(PMODIFIED_WRITER writer, PMOD_WRITE_BATCH batch)
+{
+    PPFN pfn;
+    PFN local;
+    ULONG64 target_pages = batch->num_pages;
+    PULONG64 disc_indices = batch->disc_indices;
+
+    WaitForSingleObject(batch->writes_done_event, INFINITE);
+
+    InterlockedIncrement64((volatile LONG64 *) &mod_write_batches_sized);
+    InterlockedAdd64((volatile LONG64 *) &mod_write_batch_size_total, (LONG64) batch->target_pages);
+
+#if ADAPTIVE_MOD_BATCH
+    // A batch cut short by the modified list says nothing about whether its size was right
+    // It is timed to when its writes finished, as by the time we get here the next batch may have been started in between
+    if (target_pages == batch->target_pages)
+    {
+        adjust_mod_write_batch_size(target_pages, (batch->writes_done_time - batch->start_time) / 1000);
+    }
+#endif
+
+#if PAGEFILE_DEDUP
+    // Only now that their contents are on the paging file can other pages share these slots
     for (ULONG64 i = 0; i < target_pages; i++)
     {
-        // Write the page to the page file
-        write_to_pagefile(disc_indices[i], modified_write_va);
+        if (batch->needs_write[i]) {
+            insert_dedup_slot(disc_indices[i], batch->hashes[i]);
+        }
+    }
+#endif
+
+    unmap_pages(batch->write_va, target_pages);
 
+    // For each page, update its PFN to point to its corresponding disc index
+    for (ULONG64 i = 0; i < target_pages; i++)
+    {
         // Lock the PFN. Change is possible as we are writing to the page file
-        pfn = pfn_from_frame_number(frame_numbers[i]);
+        pfn = pfn_from_frame_number(batch->frame_numbers[i]);
         lock_pfn(pfn);
         local = read_pfn(pfn);
+        local.flags.reference -= 1;
 
         // The modified bit allows us to tell whether the page was changed during the write
         // Without the bit a page that went to active and then back to modified could not be differentiated
         // From one that was never touched. If a page was written to, it could be written twice
         // And its first page file write would be stale data
-        if (local.flags.modified == 0) {
+        // A page that faulted back in while we held it is active and not on any list, so it is left where it is
+        if (local.flags.modified == 1 || local.flags.state != MODIFIED) {
+            local.flags.modified = 0;
+            write_pfn(pfn, local);
+            unlock_pfn(pfn);
+
+            // We have to throw away our copy as it is stale data now
+            if (disc_indices[i] != DISC_INDEX_FAIL_CODE && disc_indices[i] != ZERO_PAGE_DISC_INDEX) {
+                free_disc_index(disc_indices[i]);
+            }
+        }
+        // A zero page goes back to being a demand zero PTE, the next fault on it takes any free page
+        // We only hold the PFN lock here, the same as when a standby page is repurposed
+        // Faults that read the transition PTE before we changed it see the change once they get the PFN lock
+        else if (disc_indices[i] == ZERO_PAGE_DISC_INDEX) {
+            PTE pte_contents;
+            pte_contents.entire_format = 0;
+            write_pte(batch->ptes[i], pte_contents);
+
+            local.pte = NULL;
+            local.disc_index = NO_DISC_INDEX;
+            local.flags.state = FREE;
+            write_pfn(pfn, local);
+
+            // The frame holds nothing but zeroes, which is what the free list expects
+            EnterCriticalSection(&free_page_list.lock);
+            add_to_list_tail(pfn, &free_page_list);
+            LeaveCriticalSection(&free_page_list.lock);
+
+            unlock_pfn(pfn);
+        }
+        // Pages that got a copy are standby now. Each one is linked while we hold its PFN lock,
+        // As a fault can find a standby page through its PTE and unlink it the moment we let go
+        else if (disc_indices[i] != DISC_INDEX_FAIL_CODE) {
             local.disc_index = disc_indices[i];
             local.flags.state = STANDBY;
-            local.flags.reference -= 1;
             write_pfn(pfn, local);
+
+#if COMPRESSED_CACHE
+            if (IS_COMPRESSED_INDEX(disc_indices[i])) {
+                publish_compressed_page(disc_indices[i]);
+            }
+#endif
+
+            EnterCriticalSection(&standby_page_list.lock);
+            add_to_list_tail(pfn, &standby_page_list);
+            LeaveCriticalSection(&standby_page_list.lock);
+
             unlock_pfn(pfn);
         }
-        // In this case we know that the page in memory was written during our pagefile write
-        // We have to throw away our page file space as it is stale data now
+        // There was nowhere to put this page, so it goes back to the modified list for a later batch
         else {
-            local.flags.reference -= 1;
-            local.flags.modified = 0;
             write_pfn(pfn, local);
-            unlock_pfn(pfn);
 
-            free_disc_index(disc_indices[i]);
+            EnterCriticalSection(&modified_page_list.lock);
+            add_to_list_head(pfn, &modified_page_list);
+            LeaveCriticalSection(&modified_page_list.lock);
+
+            unlock_pfn(pfn);
         }
-        // Once reads are implemented, the write is still good and we should keep the copy on the disc.
-        // We just decrement our reference count
+
+        // A decommit that found this page still referenced is waiting on its flags to change
+        WakeByAddressAll(&pfn->flags);
     }
 
-    unmap_pages(modified_write_va, target_pages);
+    InterlockedAdd64((volatile LONG64 *) &zero_pages_skipped, batch->num_zero_pages);
 
-    EnterCriticalSection(&standby_page_list.lock);
+    ULONG64 pages_saved = target_pages - batch->num_needing_slots + batch->num_slotted;
+    if (pages_saved == 0)
+    {
+        return FALSE;
+    }
 
-    // Add the pages to the standby list
-    link_list_to_tail(&standby_page_list, &batch_list);
+    // Faults waiting for a page get these first, in the order they started waiting
+    hand_pages_to_waiters();
 
-    LeaveCriticalSection(&standby_page_list.lock);
+    // Batches overlap, so each one is only charged from when the one before it finished
+    // Otherwise the time spent waiting behind the previous batch would be counted twice
+    ULONG64 end_time = get_time_ns();
+    ULONG64 duration = end_time - max(batch->start_time, writer->last_finish_time);
+    writer->last_finish_time = end_time;
 
-    // Signal to other threads that pages are available
-    SetEvent(pages_available_event);
+    track_mod_write_time(duration, pages_saved);
+    return TRUE;
+}
 
-    ULONG64 end_time = GetTickCount64();
-    ULONG64 duration = end_time - start_time;
+// Writes one batch from the modified list from start to finish, without overlapping it with any other
+// Any number of writers can run this at once, as each batch is taken off the list whole
+// And its pages are marked as referenced, so no two writers share a page
+BOOLEAN write_pages_to_disc(PMODIFIED_WRITER writer)
+{
+    PMOD_WRITE_BATCH batch = &writer->batches[0];
 
-    track_mod_write_time(duration, target_pages);
-    return TRUE;
+    if (start_mod_write_batch(batch) == FALSE) {
+        return FALSE;
+    }
+    return finish_mod_write_batch(writer, batch);
+}
+
+// Writes up to num_batches batches with up to MOD_WRITE_PIPELINE_DEPTH of them in flight at once
+// While one batch is on its way to disc, the next is popped, mapped and queued, and the one before is finished
+// So the CPU work of a batch overlaps the I/O of the others instead of waiting on it
+VOID write_pipelined_batches(PMODIFIED_WRITER writer, ULONG64 num_batches)
+{
+    ULONG64 oldest = 0;
+    ULONG64 in_flight = 0;
+    BOOLEAN keep_going = TRUE;
+
+    for (ULONG64 i = 0; i < num_batches && keep_going; i++)
+    {
+        if (in_flight == MOD_WRITE_PIPELINE_DEPTH)
+        {
+            keep_going = finish_mod_write_batch(writer, &writer->batches[oldest]);
+            oldest = (oldest + 1) % MOD_WRITE_PIPELINE_DEPTH;
+            in_flight--;
+
+            if (keep_going == FALSE) {
+                break;
+            }
+        }
+
+        if (start_mod_write_batch(&writer->batches[(oldest + in_flight) % MOD_WRITE_PIPELINE_DEPTH]) == FALSE) {
+            break;
+        }
+        in_flight++;
+    }
+
+    while (in_flight > 0)
+    {
+        finish_mod_write_batch(writer, &writer->batches[oldest]);
+        oldest = (oldest + 1) % MOD_WRITE_PIPELINE_DEPTH;
+        in_flight--;
+    }
 }
 
 
 // This controls the thread that constantly writes pages to disc when prompted by other threads
 // In the future this should use a fraction of the CPU if the system cannot give it a full core
+// There is one of these for each modified writer, the scheduler only wakes the ones it wants running
 DWORD modified_write_thread(PVOID context)
 {
-    UNREFERENCED_PARAMETER(context);
+    PMODIFIED_WRITER writer = (PMODIFIED_WRITER) context;
+    ULONG64 writer_number = (ULONG64) (writer - modified_writers);
 
     // This thread needs to be able to react to handles for waking as well as exiting
     HANDLE handles[2];
 
     handles[0] = system_exit_event;
-    handles[1] = modified_writing_event;
+    handles[1] = writer->wake_event;
 
     // This waits for the system to start before doing anything
     WaitForSingleObject(system_start_event, INFINITE);
@@ -158,18 +532,21 @@ DWORD modified_write_thread(PVOID context)
         ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, 1000);
         if (index == 0)
         {
+            release_thread_magazine();
+            release_thread_direct_io();
             set_modified_status("modified write thread exited");
             break;
         }
 
-        ULONG64 batches = *(volatile ULONG64 *) (&num_batches_to_write);
-        for (ULONG64 i = 0; i < batches; i++) {
-            // TODO LM FIX What if we can't write the pages to disc
-            if (write_pages_to_disc() == FALSE)
-            {
-                break;
-            }
+        // A writer the scheduler has parked still times out every second, but it has nothing to do
+        // The slots it has cached go back to the pool, so other threads can use them while it is parked
+        if (writer_number >= active_modified_writers) {
+            release_thread_magazine();
+            continue;
         }
+
+        ULONG64 batches = *(volatile ULONG64 *) (&num_batches_to_write);
+        write_pipelined_batches(writer, batches);
     }
 
     return 0;
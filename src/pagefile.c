@@ -1,125 +1,368 @@
 #include <stdio.h>
 #include <Windows.h>
+#include <winioctl.h>
 #include "../include/vm.h"
 #include "../include/debug.h"
 
-HANDLE pagefile_handle;
-PVOID page_file;
+PAGEFILE pagefiles[MAX_PAGEFILES];
+ULONG64 number_of_pagefiles;
+CRITICAL_SECTION pagefile_resize_lock;
+CRITICAL_SECTION pagefile_stripe_lock;
+// How many times in a row the scheduler has seen enough free slots to give back the last extent
+ULONG64 low_usage_seconds;
 
 
 PBITMAP_CHUNK page_file_bitmap;
 PBITMAP_CHUNK page_file_bitmap_end;
 volatile LONG64 free_disc_spot_count;
 
-PULONG64 freed_spaces;
-volatile LONG64 freed_spaces_size;
+SUMMARY_BITMAP free_chunk_summary;
+SUMMARY_BITMAP empty_chunk_summary;
 
-volatile LONG64 last_checked_index;
+// Freed disc indices are cached in per thread magazines, which move to and from these lock free lists as a whole
+PFREED_SLOT_MAGAZINE freed_slot_magazines;
+SLIST_HEADER full_magazines;
+SLIST_HEADER empty_magazines;
+volatile LONG64 full_magazine_count;
 
+__declspec(thread) PFREED_SLOT_MAGAZINE thread_magazine;
+
+BOOLEAN direct_io;
+
+// Unbuffered reads and writes must be sector aligned, both in the file and in memory, and sectors are at most a page
+// Our own windows are page aligned, callers that hand us a buffer on their stack go through this page instead
+__declspec(thread) PVOID direct_io_bounce_page;
+// Each thread waits on its own event for the overlapped reads and writes it issues
+__declspec(thread) HANDLE direct_io_event;
+
+HANDLE pagefile_exit_event;
 
 ULONG64 add_freed_index(ULONG64 disc_index);
-ULONG64 get_freed_index();
+ULONG64 get_freed_index(VOID);
 
-ULONG64 disc_index_to_region(ULONG64 disc_index)
+// Sets the level one bit for a chunk, and the level two bit above it if it is not set already
+// Bits are read before they are set so that chunks that are already marked do not bounce between caches
+VOID set_summary_bit(PSUMMARY_BITMAP summary, ULONG64 index)
 {
-    ULONG64 region = disc_index / ((ULONG64) BITMAP_REGION_SIZE_IN_BYTES * BITMAP_REGION_SIZE_IN_BITS);
-    assert(region < BITMAP_SIZE_IN_REGIONS);
-    return region;
+    ULONG64 level1_index = index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 level1_mask = FULL_UNIT << (index % BITMAP_CHUNK_SIZE_IN_BITS);
+    ULONG64 level2_index = level1_index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 level2_mask = FULL_UNIT << (level1_index % BITMAP_CHUNK_SIZE_IN_BITS);
+
+    if ((*(volatile ULONG64 *) &summary->level1[level1_index] & level1_mask) == EMPTY_UNIT) {
+        InterlockedOr64((volatile PLONG64) &summary->level1[level1_index], level1_mask);
+    }
+
+    if ((*(volatile ULONG64 *) &summary->level2[level2_index] & level2_mask) == EMPTY_UNIT) {
+        InterlockedOr64((volatile PLONG64) &summary->level2[level2_index], level2_mask);
+    }
 }
 
-// Called with the freed_spaces_lock and the region lock held
-// Returns the updated ULONG64 with the bits set to 1
-VOID search_chunk_for_free_spots(PULONG64 disc_spot, ULONG64 first_index, PULONG count, PULONG64 disc_indices, ULONG64 num_indices)
+// Clears the level one bit for a chunk, and the level two bit above it if that empties its level one chunk
+// A bit set by another thread between our clear and our recheck is put back, so a clear never hides a set bit
+VOID clear_summary_bit(PSUMMARY_BITMAP summary, ULONG64 index)
 {
-    ULONG64 expected = *disc_spot;
+    ULONG64 level1_index = index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 level1_mask = FULL_UNIT << (index % BITMAP_CHUNK_SIZE_IN_BITS);
+    ULONG64 level2_index = level1_index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 level2_mask = FULL_UNIT << (level1_index % BITMAP_CHUNK_SIZE_IN_BITS);
 
-    // Variables for the compare exchange
-    ULONG64 desired = FULL_BITMAP_CHUNK;
-    ULONG64 compex_return;
+    if ((*(volatile ULONG64 *) &summary->level1[level1_index] & level1_mask) == EMPTY_UNIT) {
+        return;
+    }
 
+    ULONG64 old_value = InterlockedAnd64((volatile PLONG64) &summary->level1[level1_index], ~level1_mask);
+    if ((old_value & ~level1_mask) != EMPTY_BITMAP_CHUNK) {
+        return;
+    }
 
-    // Fill out the entire chunk
-    while (TRUE) {
-        compex_return = InterlockedCompareExchange64((volatile PLONG64) disc_spot, desired, expected);
+    InterlockedAnd64((volatile PLONG64) &summary->level2[level2_index], ~level2_mask);
 
-        // Check if the ULONG64 has changed since we last read it
-        if (compex_return == expected) {
-            break;
-        }
+    if (*(volatile ULONG64 *) &summary->level1[level1_index] != EMPTY_BITMAP_CHUNK) {
+        InterlockedOr64((volatile PLONG64) &summary->level2[level2_index], level2_mask);
+    }
+}
 
-        // If it was changed to FULL_BITMAP_CHUNK, then we can't add any more indices
-        if (compex_return == FULL_BITMAP_CHUNK) {
-            return;
-        }
+// Finds the first chunk at or after start_index whose summary bit is set, wrapping around the end
+// Only the level two chunks are scanned, every level one chunk we look at is known to have something set
+ULONG64 find_summary_bit(PSUMMARY_BITMAP summary, ULONG64 start_index)
+{
+    ULONG64 level1_index = start_index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 level1_value;
+    ULONG64 level2_value;
+    DWORD bit;
 
-        expected = compex_return;
+    // Check the rest of the level one chunk that we start in
+    level1_value = summary->level1[level1_index] & (FULL_BITMAP_CHUNK << (start_index % BITMAP_CHUNK_SIZE_IN_BITS));
+    if (_BitScanForward64(&bit, level1_value)) {
+        return level1_index * BITMAP_CHUNK_SIZE_IN_BITS + bit;
     }
 
-    ULONG64 disc_spot_local = desired & ~expected;
-    ULONG64 add_result;
+    // Then walk level two from the next level one chunk onwards
+    // The last step comes back around to the first level two chunk without a mask, covering what we skipped
+    ULONG64 first_level1_index = (level1_index + 1) % SUMMARY_LEVEL1_SIZE_IN_CHUNKS;
+    ULONG64 first_level2_index = first_level1_index / BITMAP_CHUNK_SIZE_IN_BITS;
 
-    // Iterate over the old value and find the indices of all the free spots we just filled
-    for (int bit = 0; bit < BITMAP_CHUNK_SIZE_IN_BITS; bit++)
+    for (ULONG64 i = 0; i <= SUMMARY_LEVEL2_SIZE_IN_CHUNKS; i++)
     {
-        ULONG64 bit_mask = (FULL_UNIT << bit);
-        if ((disc_spot_local & bit_mask) != EMPTY_UNIT) {
+        ULONG64 level2_index = (first_level2_index + i) % SUMMARY_LEVEL2_SIZE_IN_CHUNKS;
+        level2_value = *(volatile ULONG64 *) &summary->level2[level2_index];
 
-            if (*count < num_indices) {
-                // Add the index to disc_indices
-                disc_indices[*count] = first_index + bit;
-                count++;
-            } else{
-                add_result = add_freed_index(first_index + bit);
-                if (add_result == DISC_INDEX_FAIL_CODE) {
-                    break;
-                }
+        if (i == 0) {
+            level2_value &= FULL_BITMAP_CHUNK << (first_level1_index % BITMAP_CHUNK_SIZE_IN_BITS);
+        }
+
+        while (_BitScanForward64(&bit, level2_value))
+        {
+            level1_index = level2_index * BITMAP_CHUNK_SIZE_IN_BITS + bit;
+            level1_value = *(volatile ULONG64 *) &summary->level1[level1_index];
+
+            if (_BitScanForward64(&bit, level1_value)) {
+                return level1_index * BITMAP_CHUNK_SIZE_IN_BITS + bit;
             }
-            disc_spot_local &= ~bit_mask;
+
+            // Another thread emptied this level one chunk after we read level two
+            level2_value &= level2_value - 1;
         }
     }
-    // At the end of this, disc_spot_local equals every bit we could not consume
-    disc_spot_local = ~disc_spot_local;
-    InterlockedAnd64((volatile PLONG64) disc_spot, disc_spot_local);
 
-    LONG64 last_checked_index_local = first_index;
-    InterlockedExchange64(&last_checked_index, last_checked_index_local);
+    return SUMMARY_FAIL_CODE;
 }
 
-// Called with the freed_spaces_lock held, only needs to worry about the bitmap region lock
-VOID search_region_for_free_spots(ULONG64 region, PULONG count, PULONG64 disc_indices, ULONG64 num_indices)
+// Brings both summaries up to date with the current contents of a chunk
+// This must be called after every change to a chunk. Whichever thread changes the chunk last will also
+// Be the last to read it here, so the summaries always end up agreeing with it
+VOID update_chunk_summaries(ULONG64 chunk_index)
 {
-    // No lock is gotten here to make reading faster, we only need it to write once we find a free spot
+    volatile ULONG64 *chunk = (volatile ULONG64 *) &page_file_bitmap[chunk_index];
 
-    // For each char in the region
-    PULONG64 disc_region_base = page_file_bitmap + region * BITMAP_REGION_SIZE_IN_BYTES / BITMAP_CHUNK_SIZE;
-    PULONG64 disc_region_end = disc_region_base + BITMAP_REGION_SIZE_IN_BYTES / BITMAP_CHUNK_SIZE;
+    if (*chunk != FULL_BITMAP_CHUNK) {
+        set_summary_bit(&free_chunk_summary, chunk_index);
+    } else {
+        clear_summary_bit(&free_chunk_summary, chunk_index);
+        if (*chunk != FULL_BITMAP_CHUNK) {
+            set_summary_bit(&free_chunk_summary, chunk_index);
+        }
+    }
+
+    if (*chunk == EMPTY_BITMAP_CHUNK) {
+        set_summary_bit(&empty_chunk_summary, chunk_index);
+    } else {
+        clear_summary_bit(&empty_chunk_summary, chunk_index);
+        if (*chunk == EMPTY_BITMAP_CHUNK) {
+            set_summary_bit(&empty_chunk_summary, chunk_index);
+        }
+    }
+}
+
+// Counts how many free slots sit at the bottom of a chunk before the first slot in use
+ULONG64 count_trailing_free_slots(ULONG64 chunk_value)
+{
+    DWORD first_used_bit;
+
+    if (_BitScanForward64(&first_used_bit, chunk_value) == 0) {
+        return BITMAP_CHUNK_SIZE_IN_BITS;
+    }
+    return first_used_bit;
+}
+
+// Returns a mask with bit i set when slots i through i + length - 1 are all free
+// Each step ANDs the mask with a shifted copy of itself, doubling the length of the runs it describes
+// Runs that would cross the top of the chunk are not reported, those are found by extend_run instead
+ULONG64 find_free_run_starts(ULONG64 free_slots, ULONG64 length)
+{
+    ULONG64 covered = 1;
+
+    while (covered < length && free_slots != EMPTY_BITMAP_CHUNK)
+    {
+        ULONG64 shift = min(covered, length - covered);
+        free_slots &= free_slots >> shift;
+        covered += shift;
+    }
+    return free_slots;
+}
+
+// Builds a mask of length set bits starting at first_bit
+ULONG64 run_mask(ULONG64 first_bit, ULONG64 length)
+{
+    if (length == BITMAP_CHUNK_SIZE_IN_BITS) {
+        return FULL_BITMAP_CHUNK;
+    }
+    return ((FULL_UNIT << length) - 1) << first_bit;
+}
+
+// A run that reached the top of its chunk keeps going into the bottom of the chunks after it
+// This is what lets a single run cover more than 64 slots
+VOID extend_run(ULONG64 chunk_index, ULONG64 max_length, PDISC_RUN run)
+{
+    ULONG64 length;
 
-    for (PULONG64 disc_spot = disc_region_base; disc_spot < disc_region_end; disc_spot++)
+    while (run->length < max_length && ++chunk_index < BITMAP_SIZE_IN_CHUNKS)
     {
-        if (*disc_spot == FULL_BITMAP_CHUNK)
+        volatile LONG64 *chunk = (volatile LONG64 *) &page_file_bitmap[chunk_index];
+        ULONG64 expected = *chunk;
+
+        while (TRUE)
         {
-            continue;
+            length = min(count_trailing_free_slots(expected), max_length - run->length);
+            if (length == 0) {
+                return;
+            }
+
+            ULONG64 compex_return = InterlockedCompareExchange64(chunk, expected | run_mask(0, length), expected);
+            if (compex_return == expected) {
+                break;
+            }
+            expected = compex_return;
         }
 
-        // Compute the lowest disc index
-        ULONG64 lowest_disc_index = (region * BITMAP_REGION_SIZE_IN_BYTES) + (disc_spot - disc_region_base) * BITMAP_CHUNK_SIZE;
-        lowest_disc_index *= BITS_PER_BYTE;
+        run->length += length;
+        update_chunk_summaries(chunk_index);
+
+        // The run stopped inside this chunk, so it cannot continue into the next one
+        if (length != BITMAP_CHUNK_SIZE_IN_BITS) {
+            return;
+        }
+    }
+}
+
+// Claims the lowest run of at least min_length free slots in a chunk, taking at most max_length of them
+// Only the bits of the run are set, the rest of the chunk stays free for other threads
+BOOLEAN claim_run_in_chunk(ULONG64 chunk_index, ULONG64 min_length, ULONG64 max_length, PDISC_RUN run)
+{
+    volatile LONG64 *chunk = (volatile LONG64 *) &page_file_bitmap[chunk_index];
+    ULONG64 expected = *chunk;
+    ULONG64 length;
+    DWORD first_bit;
+
+    while (TRUE)
+    {
+        ULONG64 run_starts = find_free_run_starts(~expected, min_length);
+        if (run_starts == EMPTY_BITMAP_CHUNK) {
+            // The summaries may have sent us here with a stale bit, so correct them on the way out
+            update_chunk_summaries(chunk_index);
+            return FALSE;
+        }
+
+        // The lowest set bit is the start of the first run that is long enough
+        _BitScanForward64(&first_bit, run_starts);
+        length = count_trailing_free_slots(expected >> first_bit);
+        length = min(length, BITMAP_CHUNK_SIZE_IN_BITS - first_bit);
+        length = min(length, max_length);
+
+        ULONG64 compex_return = InterlockedCompareExchange64(chunk, expected | run_mask(first_bit, length), expected);
+        if (compex_return == expected) {
+            break;
+        }
+
+        // Another thread changed the chunk, look at it again with its new contents
+        expected = compex_return;
+    }
+
+    run->start = chunk_index * BITMAP_CHUNK_SIZE_IN_BITS + first_bit;
+    run->length = length;
+    update_chunk_summaries(chunk_index);
+
+    if (first_bit + length == BITMAP_CHUNK_SIZE_IN_BITS) {
+        extend_run(chunk_index, max_length, run);
+    }
+    return TRUE;
+}
+
+// Finds chunks through the summaries starting from the file's last_checked_index, claiming runs of at least
+// Min_length slots until num_indices are found. Runs of a whole chunk or more only look at chunks that are entirely free
+// The search carries on into the other files' partitions if this file has nothing left
+// Returns the number of slots claimed, the runs themselves are appended to runs
+ULONG64 search_bitmap_for_runs(PPAGEFILE file, PDISC_RUN runs, PULONG64 num_runs, ULONG64 num_indices, ULONG64 min_length)
+{
+    PSUMMARY_BITMAP summary;
+    ULONG64 count = 0;
+    ULONG64 distance = 0;
+    ULONG64 search_chunk = ((ULONG64) file->last_checked_index / BITMAP_CHUNK_SIZE_IN_BITS) % BITMAP_SIZE_IN_CHUNKS;
 
-        search_chunk_for_free_spots(disc_spot, lowest_disc_index, count, disc_indices, num_indices);
+    if (min_length >= BITMAP_CHUNK_SIZE_IN_BITS) {
+        summary = &empty_chunk_summary;
+    } else {
+        summary = &free_chunk_summary;
+    }
 
-        if (*count == num_indices)
+    while (count < num_indices)
+    {
+        ULONG64 chunk_index = find_summary_bit(summary, search_chunk);
+        if (chunk_index == SUMMARY_FAIL_CODE) {
+            break;
+        }
+
+        // Stop once we have gone all the way around the bitmap
+        distance += (chunk_index + BITMAP_SIZE_IN_CHUNKS - search_chunk) % BITMAP_SIZE_IN_CHUNKS;
+        if (distance >= BITMAP_SIZE_IN_CHUNKS) {
+            break;
+        }
+
+        // A chunk can hold several runs, so keep claiming out of it until it has nothing long enough
+        while (count < num_indices)
         {
-            // We have found enough indices, return
-            return;
+            ULONG64 wanted = num_indices - count;
+            PDISC_RUN run = &runs[*num_runs];
+
+            if (claim_run_in_chunk(chunk_index, min(min_length, wanted), wanted, run) == FALSE) {
+                break;
+            }
+
+            count += run->length;
+            (*num_runs)++;
+
+            InterlockedExchange64(&file->last_checked_index, (LONG64) (run->start + run->length));
         }
+
+        search_chunk = (chunk_index + 1) % BITMAP_SIZE_IN_CHUNKS;
+        distance++;
     }
+
+    return count;
 }
 
+// Picks the page file that the next stripe of slots comes from with smooth weighted round robin
+// Every file earns its weight in credit each time, and the richest file pays the total back for the stripe it gets
+// This interleaves the files instead of giving each its whole share in a row
+PPAGEFILE next_stripe_pagefile(VOID)
+{
+    PPAGEFILE chosen = &pagefiles[0];
+    ULONG64 total_weight = 0;
 
-ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
+    if (number_of_pagefiles == 1) {
+        return chosen;
+    }
+
+    EnterCriticalSection(&pagefile_stripe_lock);
+
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        pagefiles[i].stripe_credit += (LONG64) pagefiles[i].weight;
+        total_weight += pagefiles[i].weight;
+
+        if (pagefiles[i].stripe_credit > chosen->stripe_credit) {
+            chosen = &pagefiles[i];
+        }
+    }
+    chosen->stripe_credit -= (LONG64) total_weight;
+
+    LeaveCriticalSection(&pagefile_stripe_lock);
+    return chosen;
+}
+
+// Gets up to num_indices free disc slots as runs of contiguous slots
+// Long runs are preferred, as they let the modified writer write a whole run with a single copy and flush
+// The runs array must have room for num_indices runs, as in the worst case every run is a single slot
+// Each call takes its slots from the next page file in the stripe, so callers that want to spread a batch
+// Across the files ask for it PAGEFILE_STRIPE_SIZE slots at a time
+ULONG64 get_disc_runs(PDISC_RUN runs, PULONG64 num_runs, ULONG64 num_indices)
 {
-    ULONG count = 0;
+    ULONG64 count;
     ULONG64 return_index;
+    PPAGEFILE file;
+
+    *num_runs = 0;
 
     // If our free_disc_spot_count is zero, we can't get any indices and return without checking the bitmap
     // Volatile read is needed here for two reasons
@@ -127,93 +370,140 @@ ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
     // If another thread is changing this value at the same time, the pieces won't fit anymore
     // 2. Rereading. The compiler can substitute this read line at every single reference to this variable.
     // If it changes in the gap, we think we have a snapshot but we don't
-    if (*(volatile ULONG_PTR *) (&free_disc_spot_count) == 0)
+    if (*(volatile ULONG_PTR *) (&free_disc_spot_count) == 0 || num_indices == 0)
     {
         return 0;
     }
 
-    // Tries to get as many disc indices from the freed spaces stack as possible
+    file = next_stripe_pagefile();
+
+    // First look only for runs that can hold the whole request, or at least an entire chunk of it
+    count = search_bitmap_for_runs(file, runs, num_runs, num_indices, min(num_indices, BITMAP_CHUNK_SIZE_IN_BITS));
+
+    // Then use up the single slots cached in the magazines before breaking up the bitmap any further
     while (count < num_indices)
     {
         return_index = get_freed_index();
-        if (return_index != DISC_INDEX_FAIL_CODE)
-        {
-            disc_indices[count] = return_index;
-            count++;
-        }
-        else {
+        if (return_index == DISC_INDEX_FAIL_CODE) {
             break;
         }
+
+        runs[*num_runs].start = return_index;
+        runs[*num_runs].length = 1;
+        (*num_runs)++;
+        count++;
     }
 
-    // If we have satisfied our count, return
-    if (count == num_indices)
+    // Finally, take whatever fragments are left
+    if (count < num_indices)
     {
-        // Decrement the free_disc_spot_count by the number of indices we got
-        InterlockedAdd64(&free_disc_spot_count, 0 - (ULONG64) count);
-        return count;
+        count += search_bitmap_for_runs(file, runs, num_runs, num_indices - count, 1);
     }
 
-    // Iterate over each bitmap region looking for free spots
-    ULONG64 first_bitmap_region = disc_index_to_region(last_checked_index);
+    InterlockedAdd64(&free_disc_spot_count, 0 - (LONG64) count);
 
-    for (ULONG64 region = 0; region < BITMAP_SIZE_IN_REGIONS; region++)
+#if PAGEFILE_DEDUP
+    for (ULONG64 run = 0; run < *num_runs; run++)
     {
-        ULONG64 search_region = (first_bitmap_region + region) % BITMAP_SIZE_IN_REGIONS;
-        search_region_for_free_spots(search_region, &count, disc_indices, num_indices);
-        if (count == num_indices)
+        for (ULONG64 i = 0; i < runs[run].length; i++)
         {
-            // We have found enough indices, break
+            set_slot_reference(runs[run].start + i);
+        }
+    }
+#endif
+
+    return count;
+}
+
+// Gets up to num_indices free disc slots as individual indices
+ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
+{
+    DISC_RUN runs[MAX_DISC_RUNS];
+    ULONG64 num_runs;
+    ULONG64 count = 0;
+
+    while (count < num_indices)
+    {
+        if (get_disc_runs(runs, &num_runs, min(num_indices - count, MAX_DISC_RUNS)) == 0) {
             break;
         }
+
+        for (ULONG64 run = 0; run < num_runs; run++)
+        {
+            for (ULONG64 i = 0; i < runs[run].length; i++)
+            {
+                disc_indices[count] = runs[run].start + i;
+                count++;
+            }
+        }
     }
 
-    // If we didn't break, we found less than num_indices indices and return how many we actually got
-    // If we did break, we got num_indices indices and return that
-    InterlockedAdd64(&free_disc_spot_count, 0 - (ULONG64) count);
     return count;
 }
 
-// This function will double insert a disc index if it is called twice with the same index
-// Currently this is not a problem, as this function is only called with locks held that prevent this from happening
-VOID free_disc_index(ULONG64 disc_index)
+// Clears a slot's bit in the bitmap, the slot is not counted as free here as it already is
+VOID return_index_to_bitmap(ULONG64 disc_index)
 {
     PULONG64 disc_spot;
     ULONG64 index_in_cluster;
 
-    // Add the disc index to freed_spaces if there is space
-    if (add_freed_index(disc_index) == DISC_INDEX_FAIL_CODE) {
-        // This grabs the actual chunk (ULONG64) that holds the bit we need to change
-        disc_spot = page_file_bitmap + disc_index / BITMAP_CHUNK_SIZE_IN_BITS;
+    // This grabs the actual chunk (ULONG64) that holds the bit we need to change
+    disc_spot = page_file_bitmap + disc_index / BITMAP_CHUNK_SIZE_IN_BITS;
 
-        // This gets the bit's index inside the char
-        index_in_cluster = disc_index % BITMAP_CHUNK_SIZE_IN_BITS;
+    // This gets the bit's index inside the char
+    index_in_cluster = disc_index % BITMAP_CHUNK_SIZE_IN_BITS;
 
-        ULONG64 mask = ~(FULL_UNIT << index_in_cluster);
+    ULONG64 mask = ~(FULL_UNIT << index_in_cluster);
 
-        InterlockedAnd64((volatile PLONG64) disc_spot, mask);
+    InterlockedAnd64((volatile PLONG64) disc_spot, mask);
+    update_chunk_summaries(disc_index / BITMAP_CHUNK_SIZE_IN_BITS);
 
-        // We set the bit to be zero by comparing it using a LOGICAL AND (&=) with all ones,
-        // Except for a zero at the place we want to set as zero.
-        // We compute this comparison value by taking one positive bit (1)
-        // And left-shifting (<<) it by index_in_cluster bits to its corresponding position in the char
-        // If the position is two, then our 1 would become 001. Five more bits would then be added to the end
-        // By the compiler in order to match the size of the char it is being compared to (00100000)
-        // Then we flip these bits using the (~) operator to get our comparison value
+    // We set the bit to be zero by comparing it using a LOGICAL AND (&=) with all ones,
+    // Except for a zero at the place we want to set as zero.
+    // We compute this comparison value by taking one positive bit (1)
+    // And left-shifting (<<) it by index_in_cluster bits to its corresponding position in the char
+    // If the position is two, then our 1 would become 001. Five more bits would then be added to the end
+    // By the compiler in order to match the size of the char it is being compared to (00100000)
+    // Then we flip these bits using the (~) operator to get our comparison value
 
-        // Example: (actual byte) 11011101 &= 11111011 (comparison value)
-        // Result: 11011(0)01
-        // The zero surrounded by parenthesis is the bit we change; all others are preserved
+    // Example: (actual byte) 11011101 &= 11111011 (comparison value)
+    // Result: 11011(0)01
+    // The zero surrounded by parenthesis is the bit we change; all others are preserved
 
-        // This asserts that the disc space is not already free
-        //assert((spot_cluster & (FULL_UNIT << (index_in_cluster))) != EMPTY_UNIT);
+    // This asserts that the disc space is not already free
+    //assert((spot_cluster & (FULL_UNIT << (index_in_cluster))) != EMPTY_UNIT);
 
-        // If there is no space, then we want to move our last checked index back to the on_stack index so that we don't
-        // lose it, as it will otherwise sit in a bubble of all the spaces before last_checked_index
-        if (disc_index < last_checked_index)
-        {
-            InterlockedExchange64(&last_checked_index, disc_index);
-        }
+    // If there is no space, then we want to move our last checked index back to the on_stack index so that we don't
+    // lose it, as it will otherwise sit in a bubble of all the spaces before last_checked_index
+    PPAGEFILE file = &pagefiles[PAGEFILE_FROM_DISC_INDEX(disc_index)];
+    if ((LONG64) disc_index < file->last_checked_index)
+    {
+        InterlockedExchange64(&file->last_checked_index, (LONG64) disc_index);
+    }
+}
+
+// This function will double insert a disc index if it is called twice with the same index
+// Currently this is not a problem, as this function is only called with locks held that prevent this from happening
+VOID free_disc_index(ULONG64 disc_index)
+{
+#if COMPRESSED_CACHE
+    // Pages kept in the compressed cache never had a slot on the paging file
+    if (IS_COMPRESSED_INDEX(disc_index)) {
+        free_compressed_page(disc_index);
+        return;
+    }
+#endif
+
+#if PAGEFILE_DEDUP
+    // A slot shared by identical pages stays in use until its last owner lets go of it
+    if (release_slot_reference(disc_index) == FALSE) {
+        return;
+    }
+#endif
+
+    // Cache the disc index in this thread's magazine if there is space
+    if (add_freed_index(disc_index) == DISC_INDEX_FAIL_CODE) {
+        return_index_to_bitmap(disc_index);
     }
 
     InterlockedIncrement64(&free_disc_spot_count);
@@ -231,82 +521,606 @@ VOID free_disc_indices(PULONG64 disc_indices, ULONG64 num_indices, ULONG64 start
     }
 }
 
+// Takes an empty magazine from the pool to be a thread's own, returns NULL if every magazine is in use
+PFREED_SLOT_MAGAZINE take_empty_magazine(VOID)
+{
+    PFREED_SLOT_MAGAZINE magazine = (PFREED_SLOT_MAGAZINE) InterlockedPopEntrySList(&empty_magazines);
+
+    if (magazine != NULL) {
+        magazine->count = 0;
+    }
+    return magazine;
+}
+
+// Caches a freed disc index in the calling thread's magazine
+// When the magazine fills up, it is handed to the global pool as a whole and replaced by an empty one
+// So the only shared cache line touched is the pool's, and only once every FREED_SLOT_MAGAZINE_SIZE frees
+// Returns DISC_INDEX_FAIL_CODE if the index could not be cached and has to go back to the bitmap
 ULONG64 add_freed_index(ULONG64 disc_index)
 {
-    ULONG64 expected = freed_spaces_size;
-    if (expected == MAX_FREED_SPACES_SIZE)
+    PFREED_SLOT_MAGAZINE magazine = thread_magazine;
+
+    if (magazine == NULL)
     {
-        return DISC_INDEX_FAIL_CODE;
+        magazine = take_empty_magazine();
+        if (magazine == NULL) {
+            return DISC_INDEX_FAIL_CODE;
+        }
+        thread_magazine = magazine;
     }
-    ULONG64 desired = expected + 1;
-    ULONG64 compex_return = ~expected;
-    while (compex_return != expected)
-    {
-        compex_return = InterlockedCompareExchange64((volatile PLONG64) &freed_spaces_size, desired, expected);
 
-        if (compex_return != expected)
+    if (magazine->count == FREED_SLOT_MAGAZINE_SIZE)
+    {
+        // The pool is capped so that freed slots still make it back to the bitmap to form runs
+        if (InterlockedIncrement64(&full_magazine_count) > (LONG64) MAX_FREED_SLOT_MAGAZINES)
         {
-            expected = compex_return;
-            if (expected == MAX_FREED_SPACES_SIZE)
-            {
-                return DISC_INDEX_FAIL_CODE;
-            }
-            desired = expected + 1;
+            InterlockedDecrement64(&full_magazine_count);
+            return DISC_INDEX_FAIL_CODE;
         }
-        else
+
+        PFREED_SLOT_MAGAZINE empty_magazine = take_empty_magazine();
+        if (empty_magazine == NULL)
         {
-            break;
+            InterlockedDecrement64(&full_magazine_count);
+            return DISC_INDEX_FAIL_CODE;
         }
+
+        // The push is a full barrier, so every index is visible to whoever pops the magazine
+        InterlockedPushEntrySList(&full_magazines, &magazine->entry);
+
+        magazine = empty_magazine;
+        thread_magazine = magazine;
     }
 
-    freed_spaces[compex_return] = disc_index;
+    magazine->disc_indices[magazine->count] = disc_index;
+    magazine->count++;
+
     return disc_index;
 }
 
-// Get a disc index from the freed spaces stack
+// Get a disc index from the calling thread's magazine, refilling it with a full magazine from the pool when it runs out
 // Does not decrement the free_disc_spot_count, as this is done by the caller
-ULONG64 get_freed_index()
+ULONG64 get_freed_index(VOID)
 {
-    ULONG64 expected = freed_spaces_size;
-    if (expected == 0)
+    PFREED_SLOT_MAGAZINE magazine = thread_magazine;
+
+    if (magazine == NULL || magazine->count == 0)
     {
-        return DISC_INDEX_FAIL_CODE;
+        PFREED_SLOT_MAGAZINE full_magazine = (PFREED_SLOT_MAGAZINE) InterlockedPopEntrySList(&full_magazines);
+        if (full_magazine == NULL) {
+            return DISC_INDEX_FAIL_CODE;
+        }
+        InterlockedDecrement64(&full_magazine_count);
+
+        // Our empty magazine goes back to the pool for whichever thread fills one next
+        if (magazine != NULL) {
+            InterlockedPushEntrySList(&empty_magazines, &magazine->entry);
+        }
+
+        magazine = full_magazine;
+        thread_magazine = magazine;
     }
-    ULONG64 desired = expected - 1;
-    ULONG64 compex_return = ~expected;
-    while (compex_return != expected)
+
+    magazine->count--;
+    return magazine->disc_indices[magazine->count];
+}
+
+// Gives the calling thread's magazine back to the pool, this must be done before a thread that frees slots exits
+// A partially filled magazine is fine to put on the full list, as takers only ever use its count
+VOID release_thread_magazine(VOID)
+{
+    PFREED_SLOT_MAGAZINE magazine = thread_magazine;
+
+    if (magazine == NULL) {
+        return;
+    }
+    thread_magazine = NULL;
+
+    if (magazine->count == 0) {
+        InterlockedPushEntrySList(&empty_magazines, &magazine->entry);
+    } else {
+        InterlockedIncrement64(&full_magazine_count);
+        InterlockedPushEntrySList(&full_magazines, &magazine->entry);
+    }
+}
+
+// Puts every slot cached in the pool's full magazines back into the bitmap
+// An extent only gives its space back once every slot in it is clear in the bitmap, which cached slots are not
+// Slots in a running thread's own magazine cannot be taken, threads give theirs back when they park or exit
+VOID drain_full_magazines(VOID)
+{
+    PFREED_SLOT_MAGAZINE magazine;
+
+    while ((magazine = (PFREED_SLOT_MAGAZINE) InterlockedPopEntrySList(&full_magazines)) != NULL)
     {
-        compex_return = InterlockedCompareExchange64((volatile PLONG64) &freed_spaces_size, desired, expected);
+        InterlockedDecrement64(&full_magazine_count);
 
-        if (compex_return != expected)
+        for (ULONG64 i = 0; i < magazine->count; i++)
         {
-            expected = compex_return;
-            if (expected == 0)
-            {
-                return DISC_INDEX_FAIL_CODE;
+            return_index_to_bitmap(magazine->disc_indices[i]);
+        }
+        magazine->count = 0;
+
+        InterlockedPushEntrySList(&empty_magazines, &magazine->entry);
+    }
+}
+
+// The last extent is cut short at the end of the page file
+ULONG64 pagefile_extent_pages(ULONG64 extent)
+{
+    return min(PAGEFILE_EXTENT_SIZE_IN_PAGES, PAGES_PER_PAGEFILE - extent * PAGEFILE_EXTENT_SIZE_IN_PAGES);
+}
+
+// The first chunk of the bitmap that covers an extent, page files and extents both start on a chunk boundary
+ULONG64 pagefile_extent_first_chunk(ULONG64 file_number, ULONG64 extent)
+{
+    return (file_number * PAGES_PER_PAGEFILE + extent * PAGEFILE_EXTENT_SIZE_IN_PAGES) / BITMAP_CHUNK_SIZE_IN_BITS;
+}
+
+// Only the mapped mode has views, direct I/O goes through the file handle instead
+PVOID pagefile_address(ULONG64 disc_index)
+{
+    PPAGEFILE file = &pagefiles[PAGEFILE_FROM_DISC_INDEX(disc_index)];
+    ULONG64 offset = OFFSET_IN_PAGEFILE(disc_index);
+    PUCHAR view = file->extent_views[offset / PAGEFILE_EXTENT_SIZE_IN_PAGES];
+
+    if (view == NULL) {
+        fatal_error("pagefile_address : disc index is in an extent that is not in use");
+    }
+    return view + (offset % PAGEFILE_EXTENT_SIZE_IN_PAGES) * PAGE_SIZE;
+}
+
+// Sets the end of a page file, which for a sparse file allocates nothing on the disc
+VOID set_page_file_size(PPAGEFILE file, ULONG64 size_in_bytes)
+{
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG) size_in_bytes;
+
+    if (!SetFilePointerEx(file->handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(file->handle)) {
+        fatal_error("set_page_file_size : failed to set file size");
+    }
+}
+
+// Gives the disc space under an extent back without changing the size of the file
+// The file cannot be cut short, as Windows will not truncate a file that the lower extents still have views of
+// On a sparse file zeroing a range deallocates it. If that fails the space is only kept, so it is not fatal
+VOID release_pagefile_extent_space(PPAGEFILE file, ULONG64 extent)
+{
+    FILE_ZERO_DATA_INFORMATION zero_data;
+    DWORD bytes_returned;
+    OVERLAPPED overlapped = {0};
+
+    zero_data.FileOffset.QuadPart = (LONGLONG) (extent * PAGEFILE_EXTENT_SIZE_IN_PAGES * PAGE_SIZE);
+    zero_data.BeyondFinalZero.QuadPart = zero_data.FileOffset.QuadPart +
+                                         (LONGLONG) (pagefile_extent_pages(extent) * PAGE_SIZE);
+
+    // An overlapped handle has to be given an OVERLAPPED for this, a synchronous one just finishes before returning
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    NULL_CHECK(overlapped.hEvent, "release_pagefile_extent_space : could not create event for FSCTL_SET_ZERO_DATA")
+
+    if (!DeviceIoControl(file->handle, FSCTL_SET_ZERO_DATA, &zero_data, sizeof(zero_data), NULL, 0,
+                         &bytes_returned, &overlapped) &&
+        (GetLastError() != ERROR_IO_PENDING ||
+         !GetOverlappedResult(file->handle, &overlapped, &bytes_returned, TRUE))) {
+        printf("release_pagefile_extent_space : could not release extent %llu of %s %lu\n", extent, file->path,
+               GetLastError());
+    }
+    CloseHandle(overlapped.hEvent);
+}
+
+// Extends the file to cover an extent and maps a view of just that extent
+// The mapping handle can be closed right away, as the view keeps the mapping alive until it is unmapped
+// With direct I/O there is nothing to map, the file only has to be long enough
+// A file kept from a warm start can already be longer, and must not be cut short under the extents we have yet to map
+VOID map_pagefile_extent(PPAGEFILE file, ULONG64 extent)
+{
+    LARGE_INTEGER offset;
+    LARGE_INTEGER end;
+    LARGE_INTEGER current_size;
+
+    offset.QuadPart = (LONGLONG) (extent * PAGEFILE_EXTENT_SIZE_IN_PAGES * PAGE_SIZE);
+    end.QuadPart = offset.QuadPart + (LONGLONG) (pagefile_extent_pages(extent) * PAGE_SIZE);
+
+    if (!GetFileSizeEx(file->handle, &current_size)) {
+        fatal_error("map_pagefile_extent : failed to get file size");
+    }
+    if (current_size.QuadPart < end.QuadPart) {
+        set_page_file_size(file, (ULONG64) end.QuadPart);
+    }
+
+    if (direct_io) {
+        return;
+    }
+
+    HANDLE mapping = CreateFileMapping(file->handle, NULL, PAGE_READWRITE, end.HighPart, end.LowPart, NULL);
+    if (mapping == NULL) {
+        fatal_error("map_pagefile_extent : failed to create file mapping");
+    }
+
+    PVOID view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, offset.HighPart, offset.LowPart,
+                               pagefile_extent_pages(extent) * PAGE_SIZE);
+    if (view == NULL) {
+        fatal_error("map_pagefile_extent : failed to map view of file");
+    }
+
+    CloseHandle(mapping);
+    file->extent_views[extent] = view;
+}
+
+// Maps an extent and then hands its slots to the allocator, the view has to exist before anyone can get a slot in it
+// Called with the resize lock held, or before any other thread is running
+VOID activate_pagefile_extent(ULONG64 file_number, ULONG64 extent)
+{
+    ULONG64 first_chunk = pagefile_extent_first_chunk(file_number, extent);
+    ULONG64 num_chunks = pagefile_extent_pages(extent) / BITMAP_CHUNK_SIZE_IN_BITS;
+
+    map_pagefile_extent(&pagefiles[file_number], extent);
+
+    for (ULONG64 chunk_index = first_chunk; chunk_index < first_chunk + num_chunks; chunk_index++)
+    {
+        InterlockedExchange64((volatile LONG64 *) &page_file_bitmap[chunk_index], EMPTY_BITMAP_CHUNK);
+        update_chunk_summaries(chunk_index);
+    }
+
+    pagefiles[file_number].active_extents++;
+
+    InterlockedAdd64(&free_disc_spot_count, (LONG64) pagefile_extent_pages(extent));
+    SetEvent(disc_spot_available_event);
+}
+
+// Takes an extent's slots away from the allocator by claiming every chunk in it while the chunk is empty
+// If any slot in the extent is in use, or cached in a magazine, the claimed chunks are handed back and we fail
+// Called with the resize lock held
+BOOLEAN deactivate_pagefile_extent(ULONG64 file_number, ULONG64 extent)
+{
+    PPAGEFILE file = &pagefiles[file_number];
+    ULONG64 first_chunk = pagefile_extent_first_chunk(file_number, extent);
+    ULONG64 num_chunks = pagefile_extent_pages(extent) / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 chunk_index;
+
+    for (chunk_index = first_chunk; chunk_index < first_chunk + num_chunks; chunk_index++)
+    {
+        if (InterlockedCompareExchange64((volatile LONG64 *) &page_file_bitmap[chunk_index],
+                                         FULL_BITMAP_CHUNK, EMPTY_BITMAP_CHUNK) != EMPTY_BITMAP_CHUNK) {
+            break;
+        }
+        update_chunk_summaries(chunk_index);
+    }
+
+    if (chunk_index != first_chunk + num_chunks)
+    {
+        while (chunk_index > first_chunk)
+        {
+            chunk_index--;
+            InterlockedExchange64((volatile LONG64 *) &page_file_bitmap[chunk_index], EMPTY_BITMAP_CHUNK);
+            update_chunk_summaries(chunk_index);
+        }
+        return FALSE;
+    }
+
+    InterlockedAdd64(&free_disc_spot_count, 0 - (LONG64) pagefile_extent_pages(extent));
+    file->active_extents--;
+
+    // Nobody can own a slot in this extent anymore, so nobody can be using its view
+    PVOID view = file->extent_views[extent];
+    file->extent_views[extent] = NULL;
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+    }
+
+    release_pagefile_extent_space(file, extent);
+    return TRUE;
+}
+
+// Adds an extent to the end of a page file if we are running low on free slots
+// The file that grows is the one with the fewest extents for its weight, so space follows the stripe
+VOID grow_page_file(VOID)
+{
+    if (*(volatile LONG64 *) &free_disc_spot_count >= (LONG64) PAGEFILE_GROW_THRESHOLD) {
+        return;
+    }
+
+    EnterCriticalSection(&pagefile_resize_lock);
+
+    // Another thread may have grown a file while we waited for the lock
+    if (*(volatile LONG64 *) &free_disc_spot_count < (LONG64) PAGEFILE_GROW_THRESHOLD)
+    {
+        ULONG64 chosen = MAX_PAGEFILES;
+
+        for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+        {
+            if (pagefiles[i].active_extents == EXTENTS_PER_PAGEFILE) {
+                continue;
+            }
+            if (chosen == MAX_PAGEFILES || pagefiles[i].active_extents * pagefiles[chosen].weight <
+                                           pagefiles[chosen].active_extents * pagefiles[i].weight) {
+                chosen = i;
             }
-            desired = expected - 1;
         }
-        else
+
+        if (chosen != MAX_PAGEFILES)
+        {
+            activate_pagefile_extent(chosen, pagefiles[chosen].active_extents);
+            low_usage_seconds = 0;
+        }
+    }
+
+    LeaveCriticalSection(&pagefile_resize_lock);
+}
+
+// Called once a second by the scheduler. Gives back the last extent of a file once usage has stayed low long enough
+// Files with the most extents for their weight are tried first, and only one extent is given back each time
+VOID shrink_page_file(VOID)
+{
+    LONG64 spare_slots = *(volatile LONG64 *) &free_disc_spot_count - (LONG64) PAGEFILE_EXTENT_SIZE_IN_PAGES;
+
+    if (spare_slots < (LONG64) PAGEFILE_SHRINK_THRESHOLD)
+    {
+        low_usage_seconds = 0;
+        return;
+    }
+
+    low_usage_seconds++;
+    if (low_usage_seconds < PAGEFILE_SHRINK_DELAY_IN_SECONDS) {
+        return;
+    }
+
+    EnterCriticalSection(&pagefile_resize_lock);
+
+    drain_full_magazines();
+
+    BOOLEAN tried[MAX_PAGEFILES] = {FALSE};
+    for (ULONG64 attempt = 0; attempt < number_of_pagefiles; attempt++)
+    {
+        ULONG64 chosen = MAX_PAGEFILES;
+
+        for (ULONG64 i = 0; i < number_of_pagefiles; i++)
         {
+            if (tried[i] || pagefiles[i].active_extents <= INITIAL_PAGEFILE_EXTENTS) {
+                continue;
+            }
+            if (chosen == MAX_PAGEFILES || pagefiles[i].active_extents * pagefiles[chosen].weight >
+                                           pagefiles[chosen].active_extents * pagefiles[i].weight) {
+                chosen = i;
+            }
+        }
+
+        if (chosen == MAX_PAGEFILES) {
             break;
         }
+
+        tried[chosen] = TRUE;
+        if (deactivate_pagefile_extent(chosen, pagefiles[chosen].active_extents - 1)) {
+            break;
+        }
+    }
+    low_usage_seconds = 0;
+
+    LeaveCriticalSection(&pagefile_resize_lock);
+}
+
+// Reads or writes pages that are contiguous on one page file straight to the disc, bypassing the OS page cache
+// The handle is overlapped so that threads are not serialized on it, each thread just waits for its own I/O
+VOID direct_pagefile_io(ULONG64 disc_index, PVOID va, ULONG64 num_pages, BOOLEAN is_write)
+{
+    PPAGEFILE file = &pagefiles[PAGEFILE_FROM_DISC_INDEX(disc_index)];
+    ULONG64 offset = OFFSET_IN_PAGEFILE(disc_index) * PAGE_SIZE;
+    DWORD num_bytes = (DWORD) (num_pages * PAGE_SIZE);
+    DWORD bytes_transferred;
+    OVERLAPPED overlapped = {0};
+    BOOL issued;
+
+    if (direct_io_event == NULL)
+    {
+        direct_io_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        NULL_CHECK(direct_io_event, "direct_pagefile_io : could not create direct_io_event")
+    }
+
+    overlapped.Offset = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    overlapped.hEvent = direct_io_event;
+
+    if (is_write) {
+        issued = WriteFile(file->handle, va, num_bytes, NULL, &overlapped);
+    } else {
+        issued = ReadFile(file->handle, va, num_bytes, NULL, &overlapped);
+    }
+
+    if (issued == FALSE && GetLastError() != ERROR_IO_PENDING)
+    {
+        printf("direct_pagefile_io : could not start I/O to %s %lu\n", file->path, GetLastError());
+        fatal_error(NULL);
     }
-    ULONG64 index = freed_spaces[compex_return - 1];
 
-    return index;
+    if (GetOverlappedResult(file->handle, &overlapped, &bytes_transferred, TRUE) == FALSE ||
+        bytes_transferred != num_bytes)
+    {
+        printf("direct_pagefile_io : I/O to %s failed %lu\n", file->path, GetLastError());
+        fatal_error(NULL);
+    }
+}
+
+// Gets a page aligned buffer for callers whose own buffer is not, only single pages ever need one
+PVOID direct_io_buffer(PVOID va, ULONG64 num_pages)
+{
+    if (((ULONG_PTR) va & (PAGE_SIZE - 1)) == 0) {
+        return va;
+    }
+    if (num_pages != 1) {
+        fatal_error("direct_io_buffer : unaligned direct I/O of more than one page");
+    }
+
+    if (direct_io_bounce_page == NULL)
+    {
+        direct_io_bounce_page = VirtualAlloc(NULL, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        NULL_CHECK(direct_io_bounce_page, "direct_io_buffer : could not allocate direct_io_bounce_page")
+    }
+    return direct_io_bounce_page;
+}
+
+// Frees the calling thread's bounce page and I/O event, every thread that can touch the page file calls this as it exits
+VOID release_thread_direct_io(VOID)
+{
+    if (direct_io_bounce_page != NULL)
+    {
+        VirtualFree(direct_io_bounce_page, 0, MEM_RELEASE);
+        direct_io_bounce_page = NULL;
+    }
+    if (direct_io_event != NULL)
+    {
+        CloseHandle(direct_io_event);
+        direct_io_event = NULL;
+    }
 }
 
 VOID read_from_pagefile(ULONG64 disc_index, PVOID dst_va) {
-    PVOID file_view = (char*) page_file + disc_index * PAGE_SIZE;
-    memcpy(dst_va, file_view, PAGE_SIZE);
+    if (direct_io == FALSE)
+    {
+        memcpy(dst_va, pagefile_address(disc_index), PAGE_SIZE);
+        return;
+    }
+
+    PVOID buffer = direct_io_buffer(dst_va, 1);
+    direct_pagefile_io(disc_index, buffer, 1, FALSE);
+    if (buffer != dst_va) {
+        memcpy(dst_va, buffer, PAGE_SIZE);
+    }
 }
 
-VOID write_to_pagefile(ULONG64 disc_index, PVOID src_va) {
-    PVOID file_view = (char*) page_file + disc_index * PAGE_SIZE;
-    memcpy(file_view, src_va, PAGE_SIZE);
+// Reads num_pages pages that are contiguous both in dst_va and on the disc with one copy or one I/O per extent
+// The destination must be page aligned, which every multi page caller's window is
+VOID read_pages_from_pagefile(ULONG64 disc_index, PVOID dst_va, ULONG64 num_pages) {
+    while (num_pages > 0)
+    {
+        ULONG64 offset = OFFSET_IN_PAGEFILE(disc_index);
+        ULONG64 extent = offset / PAGEFILE_EXTENT_SIZE_IN_PAGES;
+        ULONG64 pages_in_extent = min(num_pages, pagefile_extent_pages(extent) - offset % PAGEFILE_EXTENT_SIZE_IN_PAGES);
 
-    if (!FlushViewOfFile(file_view, PAGE_SIZE)) {
-        fatal_error("Failed to flush view of file");
+        if (direct_io) {
+            direct_pagefile_io(disc_index, dst_va, pages_in_extent, FALSE);
+        } else {
+            memcpy(dst_va, pagefile_address(disc_index), pages_in_extent * PAGE_SIZE);
+        }
+
+        disc_index += pages_in_extent;
+        dst_va = (PVOID) ((ULONG_PTR) dst_va + pages_in_extent * PAGE_SIZE);
+        num_pages -= pages_in_extent;
     }
-}
\ No newline at end of file
+}
+
+// Writes num_pages pages that are contiguous both in src_va and on the disc with one copy and one flush per extent
+// Runs can cross into the next extent or page file, which live in different views
+// Direct I/O writes are write through, so they are on the disc once they complete and need no flush
+VOID write_to_pagefile(ULONG64 disc_index, PVOID src_va, ULONG64 num_pages) {
+    while (num_pages > 0)
+    {
+        ULONG64 offset = OFFSET_IN_PAGEFILE(disc_index);
+        ULONG64 extent = offset / PAGEFILE_EXTENT_SIZE_IN_PAGES;
+        ULONG64 pages_in_extent = min(num_pages, pagefile_extent_pages(extent) - offset % PAGEFILE_EXTENT_SIZE_IN_PAGES);
+
+        if (direct_io)
+        {
+            PVOID buffer = direct_io_buffer(src_va, pages_in_extent);
+            if (buffer != src_va) {
+                memcpy(buffer, src_va, PAGE_SIZE);
+            }
+            direct_pagefile_io(disc_index, buffer, pages_in_extent, TRUE);
+        }
+        else
+        {
+            PVOID file_view = pagefile_address(disc_index);
+
+            memcpy(file_view, src_va, pages_in_extent * PAGE_SIZE);
+
+            if (!FlushViewOfFile(file_view, pages_in_extent * PAGE_SIZE)) {
+                fatal_error("Failed to flush view of file");
+            }
+        }
+
+        disc_index += pages_in_extent;
+        src_va = (PVOID) ((ULONG_PTR) src_va + pages_in_extent * PAGE_SIZE);
+        num_pages -= pages_in_extent;
+    }
+}
+
+// Hands a batch of writes to the I/O threads of the files they go to, done_event is set once all of them are on disc
+// The requests, the pending count and done_time must stay alive until then, so the caller waits on done_event before returning
+VOID queue_pagefile_writes(PPAGEFILE_WRITE writes, ULONG64 num_writes, volatile LONG *pending,
+                           PULONG64 done_time, HANDLE done_event)
+{
+    if (num_writes == 0) {
+        *done_time = get_time_ns();
+        SetEvent(done_event);
+        return;
+    }
+
+    *pending = (LONG) num_writes;
+
+    for (ULONG64 i = 0; i < num_writes; i++)
+    {
+        PPAGEFILE file = &pagefiles[PAGEFILE_FROM_DISC_INDEX(writes[i].disc_index)];
+
+        writes[i].pending = pending;
+        writes[i].done_time = done_time;
+        writes[i].done_event = done_event;
+
+        EnterCriticalSection(&file->write_queue_lock);
+        insert_tail_list(&file->write_queue, &writes[i].entry);
+        LeaveCriticalSection(&file->write_queue_lock);
+
+        SetEvent(file->write_queued_event);
+    }
+}
+
+// Each page file has one of these threads, so writes to different drives are in flight at the same time
+// It takes the whole queue at once and writes it in order
+// It is only told to exit once every modified writer has, and it finishes whatever is still queued before it does
+DWORD pagefile_write_thread(PVOID context)
+{
+    PPAGEFILE file = (PPAGEFILE) context;
+    LIST_ENTRY local_queue;
+
+    HANDLE handles[2];
+    handles[0] = pagefile_exit_event;
+    handles[1] = file->write_queued_event;
+
+    while (TRUE)
+    {
+        ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE);
+
+        EnterCriticalSection(&file->write_queue_lock);
+        if (file->write_queue.Flink == &file->write_queue)
+        {
+            LeaveCriticalSection(&file->write_queue_lock);
+            if (index == 0) {
+                break;
+            }
+            continue;
+        }
+        local_queue.Flink = file->write_queue.Flink;
+        local_queue.Blink = file->write_queue.Blink;
+        local_queue.Flink->Blink = &local_queue;
+        local_queue.Blink->Flink = &local_queue;
+        file->write_queue.Flink = file->write_queue.Blink = &file->write_queue;
+        LeaveCriticalSection(&file->write_queue_lock);
+
+        PLIST_ENTRY entry = local_queue.Flink;
+        while (entry != &local_queue)
+        {
+            PPAGEFILE_WRITE write = CONTAINING_RECORD(entry, PAGEFILE_WRITE, entry);
+
+            // The request can be gone as soon as the last one in its batch is counted, so step past it first
+            entry = entry->Flink;
+
+            write_to_pagefile(write->disc_index, write->src_va, write->num_pages);
+
+            if (InterlockedDecrement(write->pending) == 0) {
+                *write->done_time = get_time_ns();
+                SetEvent(write->done_event);
+            }
+        }
+    }
+
+    release_thread_direct_io();
+    return 0;
+}
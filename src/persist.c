@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+char persist_path[MAX_PATH];
+BOOLEAN warm_start;
+BOOLEAN state_persisted;
+
+// The runs of a state file we are starting from, held between reading it and loading it
+PPERSIST_RUN persisted_runs;
+ULONG64 number_of_persisted_runs;
+
+// A state file that is cut short is not an error, the caller just starts cold
+BOOLEAN read_state_file(HANDLE handle, PVOID buffer, ULONG64 num_bytes)
+{
+    DWORD bytes_read;
+
+    if (ReadFile(handle, buffer, (DWORD) num_bytes, &bytes_read, NULL) == FALSE || bytes_read != num_bytes) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID write_state_file(HANDLE handle, PVOID buffer, ULONG64 num_bytes)
+{
+    DWORD bytes_written;
+
+    if (WriteFile(handle, buffer, (DWORD) num_bytes, &bytes_written, NULL) == FALSE || bytes_written != num_bytes) {
+        fatal_error("write_state_file : could not write the state file");
+    }
+}
+
+// A state file is only used if it was saved by a run with the same address space and the same page files
+// Every run is checked here too, as once we open the page files as they are there is no going back to a cold start
+BOOLEAN is_persisted_state_usable(PPERSIST_HEADER header)
+{
+    ULONG64 number_of_ptes = virtual_address_size / PAGE_SIZE;
+
+    if (header->magic != PERSIST_MAGIC || header->version != PERSIST_VERSION) {
+        return FALSE;
+    }
+    if (header->number_of_ptes != number_of_ptes || header->pages_per_pagefile != PAGES_PER_PAGEFILE ||
+        header->number_of_pagefiles != number_of_pagefiles) {
+        return FALSE;
+    }
+
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        if (strncmp(header->pagefile_paths[i], pagefiles[i].path, MAX_PATH) != 0) {
+            return FALSE;
+        }
+    }
+
+    for (ULONG64 i = 0; i < number_of_persisted_runs; i++)
+    {
+        PPERSIST_RUN run = &persisted_runs[i];
+
+        if (run->length == 0 || run->first_pte + run->length > number_of_ptes ||
+            run->disc_index + run->length > number_of_pagefiles * PAGES_PER_PAGEFILE) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Called once the page files are known and before they are opened, so that they are only recreated on a cold start
+VOID read_persisted_state(VOID)
+{
+    PERSIST_HEADER header;
+
+    warm_start = FALSE;
+    state_persisted = FALSE;
+
+    if (persist_path[0] == '\0') {
+        return;
+    }
+
+    set_initialize_status("initialize_system", "reading persisted state");
+
+    HANDLE handle = CreateFileA(persist_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    if (read_state_file(handle, &header, sizeof(PERSIST_HEADER)) &&
+        header.magic == PERSIST_MAGIC && header.number_of_runs <= virtual_address_size / PAGE_SIZE)
+    {
+        BOOLEAN runs_read = TRUE;
+
+        number_of_persisted_runs = header.number_of_runs;
+        persisted_runs = malloc(max(number_of_persisted_runs, 1) * sizeof(PERSIST_RUN));
+        NULL_CHECK(persisted_runs, "read_persisted_state : could not allocate memory for persisted_runs")
+
+        for (ULONG64 i = 0; i < number_of_persisted_runs; i += PERSIST_RUN_BUFFER_SIZE)
+        {
+            ULONG64 num_runs = min(PERSIST_RUN_BUFFER_SIZE, number_of_persisted_runs - i);
+            if (read_state_file(handle, persisted_runs + i, num_runs * sizeof(PERSIST_RUN)) == FALSE)
+            {
+                runs_read = FALSE;
+                break;
+            }
+        }
+
+        warm_start = runs_read && is_persisted_state_usable(&header);
+    }
+
+    CloseHandle(handle);
+
+    if (warm_start == FALSE)
+    {
+        printf("read_persisted_state : %s does not match this configuration, starting cold\n", persist_path);
+        free(persisted_runs);
+        persisted_runs = NULL;
+    }
+}
+
+// Marks a disc slot as in use by one more PTE, slots shared through dedup are named by more than one
+VOID claim_persisted_slot(ULONG64 disc_index)
+{
+    PPAGEFILE file = &pagefiles[PAGEFILE_FROM_DISC_INDEX(disc_index)];
+    ULONG64 extent = OFFSET_IN_PAGEFILE(disc_index) / PAGEFILE_EXTENT_SIZE_IN_PAGES;
+    ULONG64 chunk_index = disc_index / BITMAP_CHUNK_SIZE_IN_BITS;
+    ULONG64 bit = (ULONG64) 1 << (disc_index % BITMAP_CHUNK_SIZE_IN_BITS);
+
+    // Extents are always in use from the start of the file, so every extent up to this one has to be
+    while (file->active_extents <= extent)
+    {
+        activate_pagefile_extent(PAGEFILE_FROM_DISC_INDEX(disc_index), file->active_extents);
+    }
+
+    if (page_file_bitmap[chunk_index] & bit)
+    {
+#if PAGEFILE_DEDUP
+        InterlockedIncrement(&slot_reference_counts[disc_index]);
+        return;
+#else
+        fatal_error("claim_persisted_slot : two PTEs were saved with the same disc slot");
+#endif
+    }
+
+    page_file_bitmap[chunk_index] |= bit;
+    update_chunk_summaries(chunk_index);
+    free_disc_spot_count--;
+
+#if PAGEFILE_DEDUP
+    set_slot_reference(disc_index);
+#endif
+}
+
+// Turns every saved run back into disc format PTEs, the pages come back in as they are faulted on
+// Called after the PTEs and the slot bitmap exist and before any other thread is running
+VOID load_persisted_state(VOID)
+{
+    if (warm_start == FALSE) {
+        return;
+    }
+
+    set_initialize_status("initialize_system", "loading persisted state");
+
+    ULONG64 num_pages = 0;
+    for (ULONG64 i = 0; i < number_of_persisted_runs; i++)
+    {
+        PPERSIST_RUN run = &persisted_runs[i];
+
+        for (ULONG64 j = 0; j < run->length; j++)
+        {
+            PTE pte_contents;
+            pte_contents.entire_format = 0;
+            pte_contents.disc_format.on_disc = 1;
+            pte_contents.disc_format.disc_index = run->disc_index + j;
+
+            claim_persisted_slot(run->disc_index + j);
+            write_pte(pte_base + run->first_pte + j, pte_contents);
+        }
+        num_pages += run->length;
+    }
+
+    printf("load_persisted_state : %llu pages in %llu runs are back on the paging file\n",
+           num_pages, number_of_persisted_runs);
+
+    free(persisted_runs);
+    persisted_runs = NULL;
+
+    // Once we run, the page files change under the saved state, so it must never be loaded again
+    DeleteFileA(persist_path);
+}
+
+// Finds where a PTE's page lives on the paging file, or returns FALSE if it is still only in memory
+// Demand zero PTEs have nothing to save and are given DISC_INDEX_FAIL_CODE
+BOOLEAN find_persisted_disc_index(PPTE pte, PULONG64 disc_index)
+{
+    PTE pte_contents;
+    PPFN pfn;
+    BOOLEAN on_disc = TRUE;
+
+    *disc_index = DISC_INDEX_FAIL_CODE;
+
+    lock_pte(pte);
+    pte_contents = read_pte(pte);
+
+    if (pte_contents.memory_format.valid == 1) {
+        on_disc = FALSE;
+    } else if (pte_contents.disc_format.on_disc == 1) {
+        *disc_index = pte_contents.disc_format.disc_index;
+    } else if (pte_contents.entire_format != 0) {
+        // A standby page still has its copy on the paging file, anything else has to be written out first
+        // The modified writer can still change a transition PTE under only the PFN lock, so it is checked again
+        pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
+        lock_pfn(pfn);
+        if (read_pte(pte).entire_format != pte_contents.entire_format) {
+            on_disc = FALSE;
+        } else if (pfn->flags.state == STANDBY) {
+            *disc_index = pfn->disc_index;
+        } else {
+            on_disc = FALSE;
+        }
+        unlock_pfn(pfn);
+    }
+
+    unlock_pte(pte);
+
+#if COMPRESSED_CACHE
+    if (IS_COMPRESSED_INDEX(*disc_index)) {
+        on_disc = FALSE;
+    }
+#endif
+
+    return on_disc;
+}
+
+// Trims every active page and writes out every modified and compressed one, the same way memory pressure would
+// Returns the number of pages that are still only in memory afterwards
+ULONG64 flush_resident_pages(VOID)
+{
+    ULONG64 disc_index;
+    ULONG64 num_resident = 0;
+
+    for (PPTE pte = pte_base; pte < pte_end; pte++)
+    {
+        lock_pte(pte);
+        if (pte->memory_format.valid == 1) {
+            trim(pte);
+        }
+        unlock_pte(pte);
+    }
+
+    while (modified_page_list.num_pages != 0)
+    {
+        if (write_pages_to_disc(&modified_writers[FOREGROUND_WRITER]) == FALSE) {
+            break;
+        }
+    }
+
+#if COMPRESSED_CACHE
+    ULONG64 written_back;
+    do {
+        written_back = compressed_pages_written_back;
+        grow_page_file();
+        write_back_compressed_pages(COMPRESSED_WRITEBACK_BATCH);
+    } while (compressed_pages_written_back != written_back);
+#endif
+
+    for (PPTE pte = pte_base; pte < pte_end; pte++)
+    {
+        if (find_persisted_disc_index(pte, &disc_index) == FALSE) {
+            num_resident++;
+        }
+    }
+
+    return num_resident;
+}
+
+// Called at shutdown while the system threads are still running, as writing pages out needs the page file threads
+// Nothing is saved unless every page made it to the paging file
+VOID save_persisted_state(VOID)
+{
+    PERSIST_HEADER header;
+    PERSIST_RUN runs[PERSIST_RUN_BUFFER_SIZE];
+    ULONG64 num_buffered = 0;
+    ULONG64 num_resident = 0;
+    ULONG64 disc_index;
+
+    if (persist_path[0] == '\0') {
+        return;
+    }
+
+    set_initialize_status("deinitialize_system", "writing every resident page to the paging file");
+
+    for (ULONG64 attempt = 0; attempt < PERSIST_FLUSH_ATTEMPTS; attempt++)
+    {
+        num_resident = flush_resident_pages();
+        if (num_resident == 0) {
+            break;
+        }
+
+        // Pages a modified writer or a fault still holds are left alone, we give them a moment and go again
+        for (ULONG64 i = 0; i < active_modified_writers; i++)
+        {
+            SetEvent(modified_writers[i].wake_event);
+        }
+        Sleep(PERSIST_RETRY_DELAY_IN_MS);
+    }
+
+    if (num_resident != 0)
+    {
+        printf("save_persisted_state : %llu pages could not be written out, the state will not be saved\n", num_resident);
+        return;
+    }
+
+    set_initialize_status("deinitialize_system", "saving persisted state");
+
+    HANDLE handle = CreateFileA(persist_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        printf("save_persisted_state : could not create %s %lu\n", persist_path, GetLastError());
+        return;
+    }
+
+    memset(&header, 0, sizeof(PERSIST_HEADER));
+    header.version = PERSIST_VERSION;
+    header.number_of_ptes = (ULONG64) (pte_end - pte_base);
+    header.pages_per_pagefile = PAGES_PER_PAGEFILE;
+    header.number_of_pagefiles = number_of_pagefiles;
+    for (ULONG64 i = 0; i < number_of_pagefiles; i++)
+    {
+        snprintf(header.pagefile_paths[i], MAX_PATH, "%s", pagefiles[i].path);
+    }
+
+    // The header goes first with no magic, it is written again with the magic and the real count once the runs are all out
+    // That way a state file cut short by a crash is never mistaken for a whole one
+    header.number_of_runs = 0;
+    write_state_file(handle, &header, sizeof(PERSIST_HEADER));
+
+    PPERSIST_RUN current = NULL;
+    for (PPTE pte = pte_base; pte < pte_end; pte++)
+    {
+        if (find_persisted_disc_index(pte, &disc_index) == FALSE)
+        {
+            printf("save_persisted_state : a page came back into memory while saving, the state will not be saved\n");
+            CloseHandle(handle);
+            DeleteFileA(persist_path);
+            return;
+        }
+
+        if (disc_index == DISC_INDEX_FAIL_CODE)
+        {
+            current = NULL;
+            continue;
+        }
+
+        if (current != NULL && disc_index == current->disc_index + current->length)
+        {
+            current->length++;
+            continue;
+        }
+
+        if (num_buffered == PERSIST_RUN_BUFFER_SIZE)
+        {
+            write_state_file(handle, runs, num_buffered * sizeof(PERSIST_RUN));
+            num_buffered = 0;
+        }
+
+        current = &runs[num_buffered];
+        current->first_pte = (ULONG64) (pte - pte_base);
+        current->disc_index = disc_index;
+        current->length = 1;
+        num_buffered++;
+        header.number_of_runs++;
+    }
+
+    write_state_file(handle, runs, num_buffered * sizeof(PERSIST_RUN));
+
+    LARGE_INTEGER start;
+    start.QuadPart = 0;
+    if (SetFilePointerEx(handle, start, NULL, FILE_BEGIN) == FALSE) {
+        fatal_error("save_persisted_state : could not seek to the start of the state file");
+    }
+    header.magic = PERSIST_MAGIC;
+    write_state_file(handle, &header, sizeof(PERSIST_HEADER));
+
+    FlushFileBuffers(handle);
+    CloseHandle(handle);
+
+    printf("save_persisted_state : saved %llu runs to %s\n", header.number_of_runs, persist_path);
+    state_persisted = TRUE;
+}
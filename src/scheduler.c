@@ -7,11 +7,31 @@
 MOD_WRITE_TIME mod_write_times[MOD_WRITE_TIMES_TO_TRACK];
 ULONG64 mod_write_time_index;
 
-ULONG64 available_pages[SECONDS_TO_TRACK];
-ULONG64 available_pages_index;
-
 ULONG64 num_batches_to_write;
 
+// Set by whoever takes the available page count below the armed watermark, and by nothing else
+HANDLE scheduler_wake_event;
+// The watermark whose crossing wakes the scheduler, zero while nothing should
+volatile ULONG64 armed_watermark;
+// Every page handed out from the free and standby lists, the scheduler samples this to find the consumption rate
+// Each page is counted once as it leaves the lists, a page a fault gives back unused is taken off again
+volatile ULONG64 pages_consumed;
+// The trimmer keeps aging until the free and standby lists hold this many pages
+volatile ULONG64 trim_target;
+
+// How large the modified list may grow before threads dirtying pages are paced, set from the writers' throughput
+volatile ULONG64 dirty_limit;
+// Counts the times a thread was paced and how long it was paused for in total
+volatile ULONG64 dirty_throttles;
+volatile ULONG64 dirty_throttle_ms;
+
+// How many pages this thread has dirtied since it last checked whether it should be paced
+__declspec(thread) ULONG64 pages_dirtied;
+
+// Moving averages of pages consumed per ms and of pages one modified writer writes per ms
+DOUBLE consumption_rate;
+DOUBLE write_rate;
+
 MOD_WRITE_TIME average_mod_write_times(VOID)
 {
     MOD_WRITE_TIME average;
@@ -31,7 +51,7 @@ MOD_WRITE_TIME average_mod_write_times(VOID)
 
     if (i == 0)
     {
-        average.duration = 10;
+        average.duration = 10 * NS_PER_MS;
         average.num_pages = MAX_MOD_BATCH;
         return average;
     }
@@ -42,123 +62,213 @@ MOD_WRITE_TIME average_mod_write_times(VOID)
     return average;
 }
 
+// Every modified writer tracks its own batches here, so each one claims its own entry
 VOID track_mod_write_time(ULONG64 duration, ULONG64 num_pages)
 {
-    mod_write_times[mod_write_time_index].duration = duration;
-    mod_write_times[mod_write_time_index].num_pages = num_pages;
-    mod_write_time_index = (mod_write_time_index + 1) % MOD_WRITE_TIMES_TO_TRACK;
+    ULONG64 index = (ULONG64) (InterlockedIncrement64((volatile LONG64 *) &mod_write_time_index) - 1) % MOD_WRITE_TIMES_TO_TRACK;
+
+    mod_write_times[index].duration = duration;
+    mod_write_times[index].num_pages = num_pages;
 }
 
 
-ULONG64 average_page_consumption(VOID) {
-    ULONG64 total = 0;
+DOUBLE update_ewma(DOUBLE average, DOUBLE sample)
+{
+    if (average == 0) {
+        return sample;
+    }
+    return average + (sample - average) * EWMA_WEIGHT / 8;
+}
 
-    ULONG64 count = 0;
-    for (count = 0; count < ARRAYSIZE(available_pages); count++) {
-        if (available_pages[count] != MAXULONG64) {
-            total += available_pages[count];
-            count++;
-        }
-        else {
-            break;
-        }
+// Called every time a fault takes a page, this wakes the scheduler the first time the available pages
+// Drop below the armed watermark. Only the thread that disarms it sets the event
+VOID check_watermarks(VOID)
+{
+    ULONG64 armed = armed_watermark;
+    if (armed == 0) {
+        return;
     }
 
-    ULONG64 result = total / count;
-    if (result == 0) {
-        return 1;
+    ULONG64 consumable_pages = *(volatile ULONG_PTR *) (&free_page_list.num_pages) +
+                               *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+
+    if (consumable_pages < armed &&
+        InterlockedCompareExchange64((volatile LONG64 *) &armed_watermark, 0, (LONG64) armed) == (LONG64) armed) {
+        SetEvent(scheduler_wake_event);
     }
-    return result;
 }
 
-VOID track_available_pages(ULONG64 num_pages)
+// Paces a thread that dirties pages once the modified list is past what the writers can keep up with
+// Below half the limit nothing happens. Past it the pause grows in proportion to how far over the list is,
+// Up to DIRTY_MAX_PAUSE_MS at the limit, so latency rises smoothly with the backlog instead of stalling all at once
+// This must be called without holding any locks
+VOID balance_dirty_pages(VOID)
 {
-    // Compute the previous index
-    ULONG64 previous_index;
-    if (available_pages_index == 0) {
-        previous_index = SECONDS_TO_TRACK - 1;
+    ULONG64 limit = dirty_limit;
+    ULONG64 freerun = limit / 2;
+    ULONG64 modified_pages = modified_page_list.num_pages;
+
+    if (modified_pages <= freerun) {
+        return;
     }
-    else {
-        previous_index = available_pages_index - 1;
+
+    ULONG64 pause = DIRTY_MAX_PAUSE_MS;
+    if (modified_pages < limit) {
+        pause = DIRTY_MAX_PAUSE_MS * (modified_pages - freerun) / (limit - freerun);
     }
 
-    // If the previous index is uninitialized, we know that this is the first time we are tracking this
-    // So we set the available pages to the total number of pages - the number of pages we are tracking
-    if (available_pages[previous_index] == MAXULONG64) {
-        available_pages[available_pages_index] = physical_page_count - num_pages;
+    // The scheduler writes down everything past the freerun point, this makes sure it knows there is a backlog
+    SetEvent(scheduler_wake_event);
+
+    InterlockedIncrement64((volatile LONG64 *) &dirty_throttles);
+    InterlockedAdd64((volatile LONG64 *) &dirty_throttle_ms, (LONG64) pause);
+
+    if (pause == 0) {
+        SwitchToThread();
+    } else {
+        Sleep((DWORD) pause);
     }
-    else {
-        available_pages[available_pages_index] = available_pages[previous_index] - num_pages;
+}
+
+// Called every time a fault makes a page dirty, only every DIRTY_RATELIMIT_PAGES pages is the backlog looked at
+VOID note_page_dirtied(VOID)
+{
+    pages_dirtied++;
+    if (pages_dirtied < DIRTY_RATELIMIT_PAGES) {
+        return;
     }
 
-    available_pages_index = (available_pages_index + 1) % SECONDS_TO_TRACK;
+    pages_dirtied = 0;
+    balance_dirty_pages();
 }
 
-// This controls the thread that constantly writes pages to disc when prompted by other threads
-// In the future this should use a fraction of the CPU if the system cannot give it a full core
+// This keeps the free and standby lists between the watermarks by setting targets for the trimmer and the writers
+// It runs when the available page count crosses a watermark, and on a timer only as a fallback
+// Each time it plans for the pages that will be consumed until it next runs, plus whatever we are short of the high watermark
 DWORD task_scheduling_thread(PVOID context)
 {
     UNREFERENCED_PARAMETER(context);
 
     // This thread needs to be able to react to handles for waking as well as exiting
-    HANDLE handles[1];
+    HANDLE handles[2];
 
     handles[0] = system_exit_event;
+    handles[1] = scheduler_wake_event;
 
     // This waits for the system to start before doing anything
     WaitForSingleObject(system_start_event, INFINITE);
     // TODO LM FIX GIVE THIS THREAD ITS OWN STATUS LINE
 
+    ULONG64 interval = SCHEDULER_IDLE_INTERVAL_IN_MS;
+    ULONG64 last_sample_time = get_time_ns();
+    ULONG64 last_shrink_time = last_sample_time;
+    ULONG64 last_pages_consumed = pages_consumed;
+
     while (TRUE)
     {
-        // Wait for 1 second always unless the system is exiting
-        ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, 1000);
+        ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, (DWORD) interval);
         if (index == 0)
         {
+            release_thread_magazine();
+            release_thread_direct_io();
             set_modified_status("modified write thread exited");
             break;
         }
 
+        ULONG64 now = get_time_ns();
+
+        // The page file only gives back extents after usage has stayed low for several seconds in a row
+        if (now - last_shrink_time >= NS_PER_SECOND)
+        {
+            shrink_page_file();
+            last_shrink_time = now;
+        }
+
+        // Pages given back unused are taken off the count again, so over a quiet interval it can go down
+        ULONG64 consumed = pages_consumed;
+        LONG64 consumed_since = max((LONG64) (consumed - last_pages_consumed), 0);
+        consumption_rate = update_ewma(consumption_rate, (DOUBLE) consumed_since * NS_PER_MS /
+                                                         (DOUBLE) max(now - last_sample_time, 1));
+        last_pages_consumed = consumed;
+        last_sample_time = now;
+
+        // Batch durations are in ns, so a batch shorter than a ms still gives a real rate
+        MOD_WRITE_TIME average = average_mod_write_times();
+        write_rate = update_ewma(write_rate, (DOUBLE) average.num_pages * NS_PER_MS / (DOUBLE) max(average.duration, 1));
+
         // This count could be totally broken, as the counts of free and standby page counts are from different times
         // We can trust them both individually at that time but not together
         ULONG64 consumable_pages = *(volatile ULONG_PTR *) (&free_page_list.num_pages) +
-                                 *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+                                   *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+        ULONG64 modified_pages = modified_page_list.num_pages;
 
-        // Track the current number of available pages
-        track_available_pages(consumable_pages);
+        // Under the low watermark a crossing only wakes us once, so we look again soon instead
+        interval = consumable_pages < LOW_WATERMARK ? SCHEDULER_BUSY_INTERVAL_IN_MS : SCHEDULER_IDLE_INTERVAL_IN_MS;
 
-        // This finds the average number of pages that have been consumed in the last 16 seconds
-        ULONG64 average_pages_consumed = average_page_consumption();
+        DOUBLE expected_consumption = consumption_rate * (DOUBLE) interval;
+        DOUBLE shortfall = (DOUBLE) HIGH_WATERMARK - (DOUBLE) consumable_pages;
+        DOUBLE pages_wanted = expected_consumption + max(shortfall, 0);
 
-        MOD_WRITE_TIME average = average_mod_write_times();
-        DOUBLE per_page_cost = (DOUBLE) average.duration / (DOUBLE) average.num_pages;
+        // If we will be under the min watermark before we next run, the trimmer gets ahead by aging up to the high one
+        // Otherwise it only has to keep us above the low watermark
+        if ((DOUBLE) consumable_pages - expected_consumption < (DOUBLE) MIN_WATERMARK) {
+            trim_target = HIGH_WATERMARK;
+        }
+        else {
+            trim_target = LOW_WATERMARK;
+        }
 
-        // First, find how long it will take us to empty our modified list completely and convert to seconds
-        ULONG64 modified_pages = modified_page_list.num_pages;
-        ULONG64 time_to_empty_modified = (ULONG64) ((DOUBLE) modified_pages / per_page_cost / 1000);
-        // Second, find how long until we have no more free or standby pages
-        ULONG64 time_until_no_pages = consumable_pages / average_pages_consumed;
-
-        // Store the amount of writes we want to do in the next second
-        ULONG64 num_batches_local = 0;
-        // Find the most pages we can write in a second
-        ULONG64 max_possible_batches = (ULONG64) (1000 / per_page_cost / MAX_MOD_BATCH);
-
-        // If we don't have enough time to empty the modified list, write constantly
-        if (time_until_no_pages <= time_to_empty_modified) {
-            num_batches_local = max_possible_batches;
+        if (consumable_pages < trim_target) {
+            SetEvent(wake_aging_event);
+        }
+
+        // Dirtying threads are paced once the modified list holds more than the writers can clean in DIRTY_LIMIT_MS
+        ULONG64 limit = (ULONG64) (write_rate * NUMBER_OF_MODIFIED_WRITERS * DIRTY_LIMIT_MS);
+        dirty_limit = max(DIRTY_LIMIT_MIN, min(limit, DIRTY_LIMIT_MAX));
+
+        // Find the most batches one writer can write before we next run, and how many we want
+        // Everything past the point where pacing starts is written regardless, so paced threads are let go
+        ULONG64 batch_size = mod_write_batch_size;
+        ULONG64 max_possible_batches = max(1, (ULONG64) (write_rate * (DOUBLE) interval / (DOUBLE) batch_size));
+        ULONG64 pages_to_write = min((ULONG64) pages_wanted, modified_pages);
+        if (modified_pages > dirty_limit / 2) {
+            pages_to_write = max(pages_to_write, modified_pages - dirty_limit / 2);
+        }
+        ULONG64 num_batches_local = (pages_to_write + batch_size - 1) / batch_size;
+
+        // Under the min watermark faults are about to wait on us, so every writer writes constantly
+        if (consumable_pages < MIN_WATERMARK) {
+            num_batches_local = max_possible_batches * NUMBER_OF_MODIFIED_WRITERS;
+        }
+
+        // The watermark is armed before the writers are woken, so no crossing after this point is missed
+        if (consumable_pages >= LOW_WATERMARK) {
+            armed_watermark = LOW_WATERMARK;
+        }
+        else if (consumable_pages >= MIN_WATERMARK) {
+            armed_watermark = MIN_WATERMARK;
         }
         else {
-            // We know at this point that we have extra time so we don't need to write constantly
-            // We divide the time to empty the modified list by the time until we have no more pages
-            // This gives us a fraction of the time that we should write
-            DOUBLE fraction_used = (DOUBLE) time_to_empty_modified / (DOUBLE) time_until_no_pages;
-            num_batches_local = (ULONG64) ((DOUBLE) max_possible_batches * fraction_used);
+            armed_watermark = 0;
+        }
+
+        if (num_batches_local == 0) {
+            continue;
         }
 
-        num_batches_to_write = num_batches_local;
-        SetEvent(modified_writing_event);
+        // We run as few writers as can write that much, more writers only help once one cannot keep up
+        // The batches are split evenly between the writers we run
+        ULONG64 num_writers = (num_batches_local + max_possible_batches - 1) / max_possible_batches;
+        num_writers = max(1, min(num_writers, NUMBER_OF_MODIFIED_WRITERS));
+
+        active_modified_writers = num_writers;
+        num_batches_to_write = (num_batches_local + num_writers - 1) / num_writers;
+
+        for (ULONG64 i = 0; i < num_writers; i++)
+        {
+            SetEvent(modified_writers[i].wake_event);
+        }
     }
 
     return 0;
-}
\ No newline at end of file
+}
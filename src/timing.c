@@ -0,0 +1,79 @@
+#include <Windows.h>
+#include <intrin.h>
+#include "../include/timing.h"
+
+BOOLEAN tsc_usable;
+
+// Nanoseconds per tick of whichever counter we read, as a 32.32 fixed point number
+// A multiply and a shift is all a reading costs beyond the counter itself
+ULONG64 ns_per_tick_fixed;
+ULONG64 base_ticks;
+
+// The invariant TSC bit is in CPUID leaf 0x80000007, which older CPUs do not have
+BOOLEAN has_invariant_tsc(VOID)
+{
+    int cpu_info[4];
+
+    __cpuid(cpu_info, 0x80000000);
+    if ((ULONG) cpu_info[0] < 0x80000007) {
+        return FALSE;
+    }
+
+    __cpuid(cpu_info, 0x80000007);
+    return (cpu_info[3] & (1 << 8)) != 0;
+}
+
+ULONG64 read_ticks(VOID)
+{
+    if (tsc_usable) {
+        return __rdtsc();
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (ULONG64) counter.QuadPart;
+}
+
+// Finds the TSC's frequency by counting its ticks over a stretch of QueryPerformanceCounter time
+// Falls back to QueryPerformanceCounter itself when the TSC cannot be trusted
+VOID initialize_timing(VOID)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER qpc_start;
+    LARGE_INTEGER qpc_end;
+    ULONG64 ticks_per_second;
+
+    QueryPerformanceFrequency(&frequency);
+    tsc_usable = has_invariant_tsc();
+
+    if (tsc_usable)
+    {
+        ULONG64 qpc_calibration_ticks = (ULONG64) frequency.QuadPart * TSC_CALIBRATION_MS / 1000;
+
+        QueryPerformanceCounter(&qpc_start);
+        ULONG64 tsc_start = __rdtsc();
+        do {
+            QueryPerformanceCounter(&qpc_end);
+        } while ((ULONG64) (qpc_end.QuadPart - qpc_start.QuadPart) < qpc_calibration_ticks);
+        ULONG64 tsc_end = __rdtsc();
+
+        ticks_per_second = (tsc_end - tsc_start) * (ULONG64) frequency.QuadPart /
+                           (ULONG64) (qpc_end.QuadPart - qpc_start.QuadPart);
+    }
+    else
+    {
+        ticks_per_second = (ULONG64) frequency.QuadPart;
+    }
+
+    ns_per_tick_fixed = (NS_PER_SECOND << 32) / ticks_per_second;
+    base_ticks = read_ticks();
+}
+
+// Returns the nanoseconds since initialize_timing, this is cheap enough for every fault to call
+ULONG64 get_time_ns(VOID)
+{
+    ULONG64 high;
+    ULONG64 low = _umul128(read_ticks() - base_ticks, ns_per_tick_fixed, &high);
+
+    return (high << 32) | (low >> 32);
+}
@@ -3,7 +3,19 @@
 #include "../include/vm.h"
 #include "../include/debug.h"
 
+// Counts the pages that went straight to standby because they still matched their paging file copy
+volatile ULONG64 clean_pages_trimmed;
+
+// Counts the times a fault reclaimed pages itself, and how many pages it trimmed doing so
+volatile ULONG64 direct_reclaims;
+volatile ULONG64 direct_reclaim_pages;
+
+// Where this thread's next direct reclaim starts, so repeated reclaims move on through the thread's own allocation
+__declspec(thread) PPTE direct_reclaim_cursor;
+
 // This function puts an individual page on the modified list given its PTE
+// A page that was not written to since it came back from the paging file still has its copy there
+// So it goes straight to the standby list instead
 void trim(PPTE pte)
 {
     PPFN pfn;
@@ -42,6 +54,23 @@ void trim(PPTE pte)
     write_pte(pte, new_pte_contents);
 
     pfn_contents = read_pfn(pfn);
+
+    if (old_pte_contents.memory_format.dirty == 0 && pfn_contents.disc_index != NO_DISC_INDEX)
+    {
+        pfn_contents.flags.state = STANDBY;
+        write_pfn(pfn, pfn_contents);
+
+        EnterCriticalSection(&standby_page_list.lock);
+        add_to_list_tail(pfn, &standby_page_list);
+        LeaveCriticalSection(&standby_page_list.lock);
+
+        unlock_pfn(pfn);
+
+        InterlockedIncrement64((volatile LONG64 *) &clean_pages_trimmed);
+        hand_pages_to_waiters();
+        return;
+    }
+
     pfn_contents.flags.state = MODIFIED;
     write_pfn(pfn, pfn_contents);
 
@@ -127,6 +156,77 @@ VOID age_pte_regions()
         unlock_pte(pte);
     }
 }
+// Called by a fault that found the free and standby lists empty, before it waits for the trimmer and the writers
+// It ages up to DIRECT_RECLAIM_REGIONS regions of the allocation it faulted in, and trims up to DIRECT_RECLAIM_BATCH old pages
+// So a thread short on pages only ever gives up its own, never another allocation's working set
+// Clean pages that still have their paging file copy go straight to standby and to whoever is waiting
+// Regions another thread holds are skipped, a thread reclaiming for itself never waits on a PTE lock
+// This takes the VAD lock, so it is called without the faulting PTE's region locked
+// Returns the number of pages it trimmed
+ULONG64 direct_reclaim(PPTE faulting_pte)
+{
+    ULONG64 pages_trimmed = 0;
+    ULONG64 first_page;
+    ULONG64 num_pages;
+
+    if (get_vad_range(va_from_pte(faulting_pte), &first_page, &num_pages) == FALSE) {
+        return 0;
+    }
+
+    PPTE range_start = pte_base + first_page;
+    PPTE range_end = range_start + num_pages;
+    PPTE region_start = direct_reclaim_cursor;
+
+    // The cursor is only kept while the thread faults in the same allocation, otherwise we start where it faulted
+    if (region_start == NULL || region_start < range_start || region_start >= range_end) {
+        region_start = max(pte_base + ((ULONG64) (faulting_pte - pte_base) / PTE_REGION_SIZE) * PTE_REGION_SIZE,
+                           range_start);
+    }
+
+    for (ULONG64 region = 0; region < DIRECT_RECLAIM_REGIONS && pages_trimmed < DIRECT_RECLAIM_BATCH; region++)
+    {
+        // Regions are only ever locked whole, but the pages of a region outside our allocation are left alone
+        PPTE region_end = pte_base + ((ULONG64) (region_start - pte_base) / PTE_REGION_SIZE + 1) * PTE_REGION_SIZE;
+        if (region_end > range_end) {
+            region_end = range_end;
+        }
+
+        if (try_lock_pte(region_start))
+        {
+            for (PPTE pte = region_start; pte < region_end && pages_trimmed < DIRECT_RECLAIM_BATCH; pte++)
+            {
+                PTE local = read_pte(pte);
+                if (local.memory_format.valid == 0) {
+                    continue;
+                }
+
+                if (local.memory_format.age >= DIRECT_RECLAIM_MIN_AGE)
+                {
+                    // Pages the modified writer is holding are left valid, so only the ones that went are counted
+                    trim(pte);
+                    if (read_pte(pte).memory_format.valid == 0) {
+                        pages_trimmed++;
+                    }
+                }
+                else
+                {
+                    local.memory_format.age += 1;
+                    write_pte(pte, local);
+                }
+            }
+            unlock_pte(region_start);
+        }
+
+        region_start = region_end == range_end ? range_start : region_end;
+    }
+
+    direct_reclaim_cursor = region_start;
+
+    InterlockedIncrement64((volatile LONG64 *) &direct_reclaims);
+    InterlockedAdd64((volatile LONG64 *) &direct_reclaim_pages, (LONG64) pages_trimmed);
+    return pages_trimmed;
+}
+
 // No functions get to call this, it must be invoked in its own thread context
 DWORD trim_thread(PVOID context) {
     // This parameter only exists to satisfy the API requirements for a thread starting function
@@ -151,13 +251,14 @@ DWORD trim_thread(PVOID context) {
                                              FALSE, INFINITE);
         if (index == 0)
         {
+            release_thread_magazine();
+            release_thread_direct_io();
             set_trim_status("trimming thread exited");
             break;
         }
 
-        // This is an arbitrary condition that prompts us to trim pages when we need to
-        // In the future we will come up with a new algorithmic approach to doing this
-        while (free_page_list.num_pages + standby_page_list.num_pages <= physical_page_count / 4
+        // The scheduler sets how many free and standby pages we age towards, it raises this ahead of a burst
+        while (free_page_list.num_pages + standby_page_list.num_pages < trim_target
                && free_page_list.num_pages + standby_page_list.num_pages + modified_page_list.num_pages != physical_page_count)
         {
             age_pages();
@@ -6,6 +6,8 @@
 #include <system.h>
 
 #include "../include/debug.h"
+#include "../include/timing.h"
+#include "../include/persist.h"
 
 #pragma comment(lib, "advapi32.lib")
 
@@ -16,8 +18,15 @@
 #define BAR_WIDTH 100
 #define NUM_PASSTHROUGHS  ((ULONG64) 2)
 
+// Each thread walks its memory in order, so with this on it prefaults a region of it at a time before touching it
+// It is off by default, as prefaulted pages skip most of the fault handler's paths that this test is meant to exercise
+#define PREFAULT_SLICE    0
+
 ULONG64 num_trims = 0;
 
+// The last faulting thread to finish prints the fault latencies of every thread, once none of them are still recording
+volatile LONG faulting_threads_finished = 0;
+
 VOID full_virtual_memory_test(VOID) {
     PULONG_PTR arbitrary_va;
     // ULONG random_number;
@@ -25,12 +34,13 @@ VOID full_virtual_memory_test(VOID) {
     PULONG_PTR pointer;
     ULONG_PTR num_bytes;
     ULONG_PTR local;
+    ULONG access_type;
 
     ULONG_PTR virtual_address_size_in_pages;
 
-    ULONG start_time;
-    ULONG end_time;
-    ULONG time_elapsed;
+    ULONG64 start_time;
+    ULONG64 end_time;
+    ULONG64 time_elapsed;
 
     ULONG thread_id;
     ULONG thread_index;
@@ -49,20 +59,17 @@ VOID full_virtual_memory_test(VOID) {
     PFAULT_STATS stats = &fault_stats[thread_index];
 
     // This replaces a malloc call in our system
-    // Right now, we are just giving a set amount to the caller
-    pointer = (PULONG_PTR) allocate_memory(&num_bytes);
+    // Each thread allocates its own share of the VA space and walks only that
+    num_bytes = (virtual_address_size / NUMBER_OF_FAULTING_THREADS) & ~((ULONG_PTR) PAGE_SIZE - 1);
+    pointer = (PULONG_PTR) allocate_memory(num_bytes);
+    NULL_CHECK(pointer, "full_virtual_memory_test : could not allocate memory")
 
     virtual_address_size_in_pages = num_bytes / PAGE_SIZE;
 
     //PULONG_PTR p_end = pointer + (virtual_address_size_in_pages * PAGE_SIZE) / sizeof(ULONG_PTR);
 
-    ULONG64 slice_size = virtual_address_size_in_pages / NUMBER_OF_FAULTING_THREADS;
-    slice_size = slice_size * PAGE_SIZE / sizeof(ULONG_PTR);
-
-    ULONG64 slice_start = slice_size * thread_index;
-
     // This is where the test is actually ran
-    start_time = GetTickCount();
+    start_time = get_time_ns();
 
     for (ULONG64 passthrough = 0; passthrough < NUM_PASSTHROUGHS; passthrough++) {
 
@@ -84,10 +91,17 @@ VOID full_virtual_memory_test(VOID) {
             // This computes a random virtual address within our range
 
             // Calculate arbitrary VA from rep
-            ULONG64 offset = slice_start + (rep * PAGE_SIZE) / sizeof(ULONG_PTR);
-            offset = offset % num_bytes;
+            ULONG64 offset = (rep * PAGE_SIZE) / sizeof(ULONG_PTR);
             arbitrary_va = pointer + offset;
 
+#if PREFAULT_SLICE
+            // Only the first pass writes every page, later passes read back what it wrote
+            // Prefaulting those for writing would dirty them and throw away their paging file copies for nothing
+            if (rep % PTE_REGION_SIZE == 0) {
+                prefault_range(arbitrary_va, min(PTE_REGION_SIZE * PAGE_SIZE, num_bytes - rep * PAGE_SIZE),
+                               passthrough == 0 ? WRITE_ACCESS : READ_ACCESS);
+            }
+#endif
 
             if (rep % 10000 == 0) {
                 double fraction = (double)rep / virtual_address_size_in_pages;
@@ -96,6 +110,9 @@ VOID full_virtual_memory_test(VOID) {
 
             // Write the virtual address into each page
             page_faulted = FALSE;
+            // We start out only reading, the handler has to hear about a write before we make it
+            // So if the page needs one we go around again as a write, the same as a CPU faulting on a read only PTE
+            access_type = READ_ACCESS;
             // Try to access the virtual address, continue entering the handler until the page fault is resolved
             do {
                 __try
@@ -104,21 +121,21 @@ VOID full_virtual_memory_test(VOID) {
                     local = *arbitrary_va;
                     // This causes an error if the local value is not the same as the VA
                     // This means that we mixed up page contents between different VAs
-                    if (local != 0) {
-                        if (local != (ULONG_PTR) arbitrary_va) {
-                            fatal_error("full_virtual_memory_test : page contents are not the same as the VA");
-                        }
-                        stats->num_reaccesses++;
-                    } else {
-                        stats->num_first_accesses++;
+                    if (local != 0 && local != (ULONG_PTR) arbitrary_va) {
+                        fatal_error("full_virtual_memory_test : page contents are not the same as the VA");
                     }
 
+                    page_faulted = FALSE;
+
                     // We are trying to write the VA as a number into the page contents associated with that VA
                     if ((PULONG_PTR) local != arbitrary_va) {
-                        *arbitrary_va = (ULONG_PTR) arbitrary_va;
+                        if (access_type == WRITE_ACCESS) {
+                            *arbitrary_va = (ULONG_PTR) arbitrary_va;
+                        } else {
+                            access_type = WRITE_ACCESS;
+                            page_faulted = TRUE;
+                        }
                     }
-
-                    page_faulted = FALSE;
                 }
                 __except(EXCEPTION_EXECUTE_HANDLER)
                 {
@@ -128,27 +145,45 @@ VOID full_virtual_memory_test(VOID) {
                 // We call the page fault handler no matter what
                 // This is because we want to reset the age of a PTE when its VA is accessed
                 // This is done in the handler, as is referred to in this program as a fake fault
-                page_fault_handler(arbitrary_va, stats);
+                page_fault_handler(arbitrary_va, access_type, stats);
 
             } while (page_faulted == TRUE);
+
+            if (local != 0) {
+                stats->num_reaccesses++;
+            } else {
+                stats->num_first_accesses++;
+            }
         }
     }
 
     // This gets the time elapsed in milliseconds
-    end_time = GetTickCount();
-    time_elapsed = end_time - start_time;
+    end_time = get_time_ns();
+    time_elapsed = (end_time - start_time) / NS_PER_MS;
 
     // Final status update
     // TODO
 
     // Consolidated into one print statement
     printf("\nfull_virtual_memory_test : thread %lu finished accessing %llu passthroughs "
-           "of the virtual address space (%llu addresses total) in %lu ms (%f s)\n"
+           "of the virtual address space (%llu addresses total) in %llu ms (%f s)\n"
            "full_virtual_memory_test : thread %lu took %llu faults and %llu fake faults\n"
            "full_virtual_memory_test : thread %lu took %llu first accesses and %llu reaccesses\n\n",
            thread_index, NUM_PASSTHROUGHS, NUM_PASSTHROUGHS * virtual_address_size_in_pages, time_elapsed, time_elapsed / 1000.0,
            thread_index, stats->num_faults, stats->num_fake_faults,
            thread_index, stats->num_first_accesses, stats->num_reaccesses);
+
+    // The memory is given back once we are done with it, so none of it is written to the paging file after this
+    // When the address space is being persisted it has to stay as it is for the next run to pick up
+    if (persist_path[0] == '\0') {
+        free_memory(pointer);
+    }
+
+    if (InterlockedIncrement(&faulting_threads_finished) == NUMBER_OF_FAULTING_THREADS)
+    {
+        printf("full_virtual_memory_test : fault latencies across all %d threads\n", NUMBER_OF_FAULTING_THREADS);
+        print_fault_latencies();
+    }
 }
 
 // This function controls a faulting thread
@@ -160,5 +195,10 @@ DWORD faulting_thread(PVOID context)
 
     full_virtual_memory_test();
 
+    // The slots this thread cached go back to the pool, or they would count as free without anyone able to use them
+    release_thread_magazine();
+    release_thread_direct_io();
+    release_region_window();
+
     return 0;
 }
\ No newline at end of file
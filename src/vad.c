@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PVAD vad_root;
+SRWLOCK vad_lock;
+
+volatile ULONG64 vad_pages_released;
+
+// These keep the tree balanced, so that no VAD is more than O(log n) steps from the root
+ULONG64 vad_height(PVAD vad)
+{
+    return vad == NULL ? 0 : vad->height;
+}
+
+VOID update_vad_height(PVAD vad)
+{
+    vad->height = 1 + max(vad_height(vad->left), vad_height(vad->right));
+}
+
+PVAD rotate_vad_right(PVAD vad)
+{
+    PVAD left = vad->left;
+
+    vad->left = left->right;
+    left->right = vad;
+    update_vad_height(vad);
+    update_vad_height(left);
+    return left;
+}
+
+PVAD rotate_vad_left(PVAD vad)
+{
+    PVAD right = vad->right;
+
+    vad->right = right->left;
+    right->left = vad;
+    update_vad_height(vad);
+    update_vad_height(right);
+    return right;
+}
+
+// Restores the height difference of at most one between a VAD's subtrees, returns the new root of the subtree
+PVAD balance_vad(PVAD vad)
+{
+    update_vad_height(vad);
+
+    if (vad_height(vad->left) > vad_height(vad->right) + 1)
+    {
+        if (vad_height(vad->left->left) < vad_height(vad->left->right)) {
+            vad->left = rotate_vad_left(vad->left);
+        }
+        return rotate_vad_right(vad);
+    }
+    if (vad_height(vad->right) > vad_height(vad->left) + 1)
+    {
+        if (vad_height(vad->right->right) < vad_height(vad->right->left)) {
+            vad->right = rotate_vad_right(vad->right);
+        }
+        return rotate_vad_left(vad);
+    }
+    return vad;
+}
+
+PVAD insert_vad(PVAD root, PVAD vad)
+{
+    if (root == NULL) {
+        return vad;
+    }
+
+    if (vad->start_page < root->start_page) {
+        root->left = insert_vad(root->left, vad);
+    } else {
+        root->right = insert_vad(root->right, vad);
+    }
+    return balance_vad(root);
+}
+
+PVAD remove_vad(PVAD root, PVAD vad)
+{
+    if (root == NULL) {
+        return NULL;
+    }
+
+    if (vad->start_page < root->start_page) {
+        root->left = remove_vad(root->left, vad);
+    } else if (vad->start_page > root->start_page) {
+        root->right = remove_vad(root->right, vad);
+    } else {
+        if (root->left == NULL) {
+            return root->right;
+        }
+        if (root->right == NULL) {
+            return root->left;
+        }
+
+        // A VAD with two subtrees is replaced by the first VAD after it, which has no left subtree
+        PVAD successor = root->right;
+        while (successor->left != NULL) {
+            successor = successor->left;
+        }
+        successor->right = remove_vad(root->right, successor);
+        successor->left = root->left;
+        root = successor;
+    }
+    return balance_vad(root);
+}
+
+// Finds the VAD a page is in, or NULL if it is not reserved. The caller holds the VAD lock
+PVAD find_vad(ULONG64 page)
+{
+    PVAD vad = vad_root;
+
+    while (vad != NULL)
+    {
+        if (page < vad->start_page) {
+            vad = vad->left;
+        } else if (page >= vad->start_page + vad->num_pages) {
+            vad = vad->right;
+        } else {
+            return vad;
+        }
+    }
+    return NULL;
+}
+
+// Walks the VADs in address order for the first gap of num_pages, cursor is the first page after the last VAD seen
+// This is only done when reserving, so it is allowed to visit every VAD
+BOOLEAN find_vad_gap(PVAD vad, ULONG64 num_pages, PULONG64 cursor)
+{
+    if (vad == NULL) {
+        return FALSE;
+    }
+
+    if (find_vad_gap(vad->left, num_pages, cursor)) {
+        return TRUE;
+    }
+    if (vad->start_page - *cursor >= num_pages) {
+        return TRUE;
+    }
+
+    *cursor = vad->start_page + vad->num_pages;
+    return find_vad_gap(vad->right, num_pages, cursor);
+}
+
+// Finds the VAD that holds the whole of a range, and the pages the range covers
+// Returns NULL if any part of the range is not reserved or it spans more than one VAD. The caller holds the VAD lock
+PVAD find_vad_for_range(PVOID virtual_address, ULONG64 num_bytes, PULONG64 first_page, PULONG64 num_pages)
+{
+    ULONG_PTR start = (ULONG_PTR) virtual_address;
+    ULONG_PTR base = (ULONG_PTR) va_base;
+
+    if (num_bytes == 0 || start < base || start - base >= virtual_address_size ||
+        num_bytes > virtual_address_size - (start - base)) {
+        return NULL;
+    }
+
+    *first_page = (start - base) / PAGE_SIZE;
+    *num_pages = (start - base + num_bytes + PAGE_SIZE - 1) / PAGE_SIZE - *first_page;
+
+    PVAD vad = find_vad(*first_page);
+    if (vad == NULL || *first_page + *num_pages > vad->start_page + vad->num_pages) {
+        return NULL;
+    }
+    return vad;
+}
+
+VOID set_commit_bits(PVAD vad, ULONG64 first_page, ULONG64 num_pages, BOOLEAN committed)
+{
+    for (ULONG64 page = first_page - vad->start_page; page < first_page - vad->start_page + num_pages; page++)
+    {
+        if (committed) {
+            vad->commit_bitmap[page / 64] |= (ULONG64) 1 << (page % 64);
+        } else {
+            vad->commit_bitmap[page / 64] &= ~((ULONG64) 1 << (page % 64));
+        }
+    }
+}
+
+// Unmaps the pages that were still valid, then zeroes the frames and puts them on the free list
+// Their PTEs are already zero and we still hold their PFN locks, which are let go of here
+VOID free_released_frames(PPFN *pfns, PULONG_PTR frame_numbers, ULONG64 num_frames, PVOID *user_vas, ULONG64 num_mapped)
+{
+    if (num_mapped != 0) {
+        unmap_pages_scatter(user_vas, num_mapped);
+    }
+
+    if (num_frames == 0) {
+        return;
+    }
+
+    // The free list only holds zeroed pages, and these still have whatever the application left in them
+    PVOID window = get_region_window();
+    map_pages(window, num_frames, frame_numbers);
+    memset(window, 0, num_frames * PAGE_SIZE);
+    unmap_pages(window, num_frames);
+
+    for (ULONG64 j = 0; j < num_frames; j++)
+    {
+        PFN pfn_contents = read_pfn(pfns[j]);
+
+        pfn_contents.pte = NULL;
+        pfn_contents.disc_index = NO_DISC_INDEX;
+        pfn_contents.flags.state = FREE;
+        pfn_contents.flags.modified = 0;
+        write_pfn(pfns[j], pfn_contents);
+    }
+
+    EnterCriticalSection(&free_page_list.lock);
+    for (ULONG64 j = 0; j < num_frames; j++)
+    {
+        add_to_list_head(pfns[j], &free_page_list);
+    }
+    LeaveCriticalSection(&free_page_list.lock);
+
+    for (ULONG64 j = 0; j < num_frames; j++)
+    {
+        unlock_pfn(pfns[j]);
+    }
+}
+
+// Gives back every page of num_ptes PTEs that are all in one region, and returns their PTEs to zero
+// Frames go straight to the free list and slots back to the paging file, so none of these pages are ever written
+// Pages being read in or written out still belong to the thread doing that, so we let go of the region and wait for them
+// Returns how many pages had a frame or a slot to give back
+ULONG64 release_region_pages(PPTE first_pte, ULONG64 num_ptes)
+{
+    PPFN pfns[PTE_REGION_SIZE];
+    ULONG_PTR frame_numbers[PTE_REGION_SIZE];
+    PVOID user_vas[PTE_REGION_SIZE];
+    ULONG64 num_frames = 0;
+    ULONG64 num_mapped = 0;
+    ULONG64 num_released = 0;
+    ULONG64 i = 0;
+    PTE zero_pte;
+
+    zero_pte.entire_format = 0;
+
+    lock_pte(first_pte);
+
+    while (i < num_ptes)
+    {
+        PPTE pte = first_pte + i;
+        PTE pte_contents = read_pte(pte);
+        PPFN pfn;
+
+        if (pte_contents.entire_format == 0) {
+            i++;
+            continue;
+        }
+
+        if (pte_contents.memory_format.valid == 0 && pte_contents.disc_format.on_disc == 1)
+        {
+            write_pte(pte, zero_pte);
+            free_disc_index(pte_contents.disc_format.disc_index);
+            num_released++;
+            i++;
+            continue;
+        }
+
+        if (pte_contents.memory_format.valid == 1) {
+            pfn = pfn_from_frame_number(pte_contents.memory_format.frame_number);
+        } else {
+            pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
+        }
+        lock_pfn(pfn);
+
+        // The same as on a soft fault, a transition page could have been repurposed before we got its lock
+        if (read_pte(pte).entire_format != pte_contents.entire_format) {
+            unlock_pfn(pfn);
+            continue;
+        }
+
+        // Even an active page can still be held by a modified writer that took it before it faulted back in
+        // The frames we already have are given back first, so we hold no PFN locks and leave nothing mapped while we wait
+        // The reader and the writer both wake the page's flags when they let go of it
+        if (pfn->flags.state == READ_IN_PROGRESS || pfn->flags.reference != 0)
+        {
+            PFN_FLAGS flags = pfn->flags;
+            unlock_pfn(pfn);
+
+            free_released_frames(pfns, frame_numbers, num_frames, user_vas, num_mapped);
+            num_frames = 0;
+            num_mapped = 0;
+
+            unlock_pte(first_pte);
+            WaitOnAddress(&pfn->flags, &flags, sizeof(PFN_FLAGS), INFINITE);
+            lock_pte(first_pte);
+            continue;
+        }
+
+        if (pte_contents.memory_format.valid == 1) {
+            user_vas[num_mapped] = va_from_pte(pte);
+            num_mapped++;
+        } else if (pfn->flags.state == MODIFIED) {
+            EnterCriticalSection(&modified_page_list.lock);
+            remove_from_list(pfn);
+            LeaveCriticalSection(&modified_page_list.lock);
+        } else {
+            EnterCriticalSection(&standby_page_list.lock);
+            remove_from_list(pfn);
+            LeaveCriticalSection(&standby_page_list.lock);
+        }
+
+        write_pte(pte, zero_pte);
+        if (pfn->disc_index != NO_DISC_INDEX) {
+            free_disc_index(pfn->disc_index);
+        }
+
+        pfns[num_frames] = pfn;
+        frame_numbers[num_frames] = frame_number_from_pfn(pfn);
+        num_frames++;
+        num_released++;
+        i++;
+    }
+
+    free_released_frames(pfns, frame_numbers, num_frames, user_vas, num_mapped);
+
+    unlock_pte(first_pte);
+    return num_released;
+}
+
+// Gives back the pages of a range a region at a time. Their commit bits must already be clear,
+// So that no fault can bring a page back in behind us
+VOID release_pages(ULONG64 first_page, ULONG64 num_pages)
+{
+    PPTE pte = pte_base + first_page;
+    PPTE end = pte + num_pages;
+    ULONG64 num_released = 0;
+
+    while (pte < end)
+    {
+        PPTE region_end = pte_base + ((pte - pte_base) / PTE_REGION_SIZE + 1) * PTE_REGION_SIZE;
+        ULONG64 num_ptes = min(region_end, end) - pte;
+
+        num_released += release_region_pages(pte, num_ptes);
+        pte += num_ptes;
+    }
+
+    InterlockedAdd64((volatile LONG64 *) &vad_pages_released, (LONG64) num_released);
+
+    // The freed frames go to faults waiting for a page first
+    hand_pages_to_waiters();
+}
+
+// Reserves a range of num_bytes rounded up to pages, none of it is committed yet
+// Returns NULL if there is no gap in the VA space big enough
+PVOID reserve_memory(ULONG64 num_bytes)
+{
+    ULONG64 num_pages = (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    ULONG64 total_pages = virtual_address_size / PAGE_SIZE;
+    ULONG64 cursor = 0;
+    PVAD vad;
+
+    if (num_pages == 0 || num_pages > total_pages) {
+        return NULL;
+    }
+
+    vad = (PVAD) malloc(sizeof(VAD));
+    NULL_CHECK(vad, "reserve_memory : could not allocate memory for a vad")
+
+    vad->commit_bitmap = (PULONG64) calloc((num_pages + 63) / 64, sizeof(ULONG64));
+    NULL_CHECK(vad->commit_bitmap, "reserve_memory : could not allocate memory for a vad's commit_bitmap")
+
+    vad->left = NULL;
+    vad->right = NULL;
+    vad->height = 1;
+    vad->num_pages = num_pages;
+
+    AcquireSRWLockExclusive(&vad_lock);
+
+    if (find_vad_gap(vad_root, num_pages, &cursor) == FALSE && total_pages - cursor < num_pages)
+    {
+        ReleaseSRWLockExclusive(&vad_lock);
+        free(vad->commit_bitmap);
+        free(vad);
+        return NULL;
+    }
+
+    vad->start_page = cursor;
+    vad_root = insert_vad(vad_root, vad);
+
+    ReleaseSRWLockExclusive(&vad_lock);
+
+    return (PVOID) ((ULONG_PTR) va_base + cursor * PAGE_SIZE);
+}
+
+// Commits every page a range touches, which must all be in one reservation
+// Nothing is done to the PTEs, committed pages fault in as demand zero pages the first time they are touched
+BOOLEAN commit_memory(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG64 first_page;
+    ULONG64 num_pages;
+
+    AcquireSRWLockExclusive(&vad_lock);
+
+    PVAD vad = find_vad_for_range(virtual_address, num_bytes, &first_page, &num_pages);
+    if (vad != NULL) {
+        set_commit_bits(vad, first_page, num_pages, TRUE);
+    }
+
+    ReleaseSRWLockExclusive(&vad_lock);
+    return vad != NULL;
+}
+
+// Decommits every page a range touches and gives back their frames and slots, the range stays reserved
+BOOLEAN decommit_memory(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG64 first_page;
+    ULONG64 num_pages;
+
+    AcquireSRWLockExclusive(&vad_lock);
+
+    PVAD vad = find_vad_for_range(virtual_address, num_bytes, &first_page, &num_pages);
+    if (vad != NULL) {
+        set_commit_bits(vad, first_page, num_pages, FALSE);
+    }
+
+    ReleaseSRWLockExclusive(&vad_lock);
+
+    if (vad == NULL) {
+        return FALSE;
+    }
+
+    release_pages(first_page, num_pages);
+    return TRUE;
+}
+
+// Frees a whole reservation, virtual_address must be where it starts
+// Its pages are given back before it leaves the tree, so the range cannot be reserved again while they are still there
+BOOLEAN free_memory(PVOID virtual_address)
+{
+    ULONG64 first_page;
+    ULONG64 num_pages;
+
+    AcquireSRWLockExclusive(&vad_lock);
+
+    PVAD vad = find_vad_for_range(virtual_address, 1, &first_page, &num_pages);
+    if (vad == NULL || vad->start_page != first_page ||
+        ((ULONG_PTR) virtual_address & (PAGE_SIZE - 1)) != 0)
+    {
+        ReleaseSRWLockExclusive(&vad_lock);
+        return FALSE;
+    }
+    set_commit_bits(vad, vad->start_page, vad->num_pages, FALSE);
+
+    ReleaseSRWLockExclusive(&vad_lock);
+
+    release_pages(vad->start_page, vad->num_pages);
+
+    AcquireSRWLockExclusive(&vad_lock);
+    vad_root = remove_vad(vad_root, vad);
+    ReleaseSRWLockExclusive(&vad_lock);
+
+    free(vad->commit_bitmap);
+    free(vad);
+    return TRUE;
+}
+
+// Reserves and commits num_bytes, the same as malloc would give the application
+PVOID allocate_memory(ULONG64 num_bytes)
+{
+    PVOID virtual_address = reserve_memory(num_bytes);
+
+    if (virtual_address != NULL) {
+        commit_memory(virtual_address, num_bytes);
+    }
+    return virtual_address;
+}
+
+// Faults call this with their PTE region locked, which is why the VAD lock is never held while taking a PTE lock
+BOOLEAN is_committed(PVOID virtual_address)
+{
+    ULONG64 page = ((ULONG_PTR) virtual_address - (ULONG_PTR) va_base) / PAGE_SIZE;
+    BOOLEAN committed = FALSE;
+
+    AcquireSRWLockShared(&vad_lock);
+
+    PVAD vad = find_vad(page);
+    if (vad != NULL)
+    {
+        page -= vad->start_page;
+        committed = (vad->commit_bitmap[page / 64] & ((ULONG64) 1 << (page % 64))) != 0;
+    }
+
+    ReleaseSRWLockShared(&vad_lock);
+    return committed;
+}
+
+// Finds the range of pages reserved along with a VA, so a thread can keep its work to its own allocation
+// Returns FALSE if the VA is not reserved. This takes the VAD lock, so it must not be called holding a PTE lock
+BOOLEAN get_vad_range(PVOID virtual_address, PULONG64 first_page, PULONG64 num_pages)
+{
+    ULONG64 page = ((ULONG_PTR) virtual_address - (ULONG_PTR) va_base) / PAGE_SIZE;
+
+    AcquireSRWLockShared(&vad_lock);
+
+    PVAD vad = find_vad(page);
+    if (vad != NULL)
+    {
+        *first_page = vad->start_page;
+        *num_pages = vad->num_pages;
+    }
+
+    ReleaseSRWLockShared(&vad_lock);
+    return vad != NULL;
+}
+
+VOID free_vad_tree(PVAD vad)
+{
+    if (vad == NULL) {
+        return;
+    }
+
+    free_vad_tree(vad->left);
+    free_vad_tree(vad->right);
+    free(vad->commit_bitmap);
+    free(vad);
+}
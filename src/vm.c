@@ -2,17 +2,33 @@
 #include <stdio.h>
 #include "../include/vm.h"
 #include "../include/debug.h"
+#include "../include/benchmarks.h"
+#include "../include/userapp.h"
+
+#pragma comment(lib, "Synchronization.lib")
 
 PPFN get_free_page(VOID);
-PPFN read_page_on_disc(PPTE pte, PPFN free_page);
+PPFN read_page_on_disc(ULONG64 disc_index, PPFN free_page);
 
 ULONG_PTR virtual_address_size;
 ULONG_PTR physical_page_count;
 PVOID va_base;
 PVOID va__end;
-PVOID modified_write_va;
-PVOID modified_read_va;
-PVOID repurpose_zero_va;
+PPAGE_WINDOW page_windows;
+SLIST_HEADER free_page_windows;
+
+LIST_ENTRY page_waiters;
+CRITICAL_SECTION page_waiters_lock;
+volatile LONG64 num_page_waiters;
+
+// Counts the faults that found their page already being read in and waited for that read instead
+volatile ULONG64 read_collisions;
+
+// Counts the pages prefault_range resolved, each of these is a fault that never had to be taken
+volatile ULONG64 prefaulted_pages;
+
+// Each thread that works on a region's pages at once gets a window a region long to map them into
+__declspec(thread) PVOID region_window_va;
 
 // This breaks into the debugger if possible,
 // Otherwise it crashes the program
@@ -44,8 +60,67 @@ VOID unmap_pages(PVOID virtual_address, ULONG_PTR num_pages)
     }
 }
 
-// This is how we get pages for new virtual addresses as well as old ones only exist on the paging file
-PPFN get_free_page(VOID) {
+// Maps pages to VAs that are not next to each other with one call, the two arrays line up entry by entry
+VOID map_pages_scatter(PVOID *virtual_addresses, ULONG_PTR num_pages, PULONG_PTR page_array)
+{
+    if (MapUserPhysicalPagesScatter(virtual_addresses, num_pages, page_array) == FALSE) {
+        printf("map_pages_scatter : could not map %llu pages starting at VA %p\n", num_pages, virtual_addresses[0]);
+        fatal_error(NULL);
+    }
+}
+
+// Unmaps pages from VAs that are not next to each other with one call
+VOID unmap_pages_scatter(PVOID *virtual_addresses, ULONG_PTR num_pages)
+{
+    if (MapUserPhysicalPagesScatter(virtual_addresses, num_pages, NULL) == FALSE) {
+        printf("unmap_pages_scatter : could not unmap %llu pages starting at VA %p\n", num_pages, virtual_addresses[0]);
+        fatal_error(NULL);
+    }
+}
+
+// Gets this thread's region long window, it is only reserved the first time the thread needs it
+PVOID get_region_window(VOID)
+{
+    if (region_window_va == NULL)
+    {
+        region_window_va = VirtualAlloc(NULL, PAGE_SIZE * PTE_REGION_SIZE, MEM_RESERVE | MEM_PHYSICAL, PAGE_READWRITE);
+        NULL_CHECK(region_window_va, "get_region_window : could not reserve memory for region_window_va")
+    }
+    return region_window_va;
+}
+
+// Frees this thread's region long window, every thread that prefaults or gives back memory calls this as it exits
+VOID release_region_window(VOID)
+{
+    if (region_window_va != NULL)
+    {
+        VirtualFree(region_window_va, 0, MEM_RELEASE);
+        region_window_va = NULL;
+    }
+}
+
+// Borrows a window from the pool, if every window is out we wait for one to come back
+PPAGE_WINDOW take_page_window(VOID)
+{
+    PPAGE_WINDOW window;
+
+    while ((window = (PPAGE_WINDOW) InterlockedPopEntrySList(&free_page_windows)) == NULL)
+    {
+        YieldProcessor();
+    }
+
+    return window;
+}
+
+// The window must be unmapped before it is given back
+VOID release_page_window(PPAGE_WINDOW window)
+{
+    InterlockedPushEntrySList(&free_page_windows, &window->entry);
+}
+
+// Takes a page off the free or standby list no matter who else is waiting for one
+// Only hand_pages_to_waiters calls this directly, everything else goes through get_free_page
+PPFN take_free_page(VOID) {
     PPFN free_page = NULL;
 
     // First, we check the free page list for pages
@@ -85,61 +160,224 @@ PPFN get_free_page(VOID) {
         // It also would allow a program to see another program's memory (HUGE SECURITY VIOLATION)
         ULONG_PTR frame_number = frame_number_from_pfn(free_page);
 
-        EnterCriticalSection(&repurpose_zero_va_lock);
+        PPAGE_WINDOW window = take_page_window();
 
-        map_pages(repurpose_zero_va, 1, &frame_number);
+        map_pages(window->va, 1, &frame_number);
 
-        memset(repurpose_zero_va, 0, PAGE_SIZE);
+        memset(window->va, 0, PAGE_SIZE);
 
         // Unmap the page from our va space
-        unmap_pages(repurpose_zero_va, 1);
+        unmap_pages(window->va, 1);
 
-        LeaveCriticalSection(&repurpose_zero_va_lock);
+        release_page_window(window);
     }
 
-    // This is a last resort option when there are no available pages
-    // We wake the aging thread and send this information to the fault handler
-    // Which then waits on a page to become available
-    // Aging is done here no matter what
-    SetEvent(wake_aging_event);
-    // Once we have depleted a page from the free/standby list, it is a good idea to consider aging
+    // Once we have depleted a page from the free/standby list, the scheduler decides whether the trimmer
+    // And the writers need to do anything about it. It is only woken when we cross one of its watermarks
+    InterlockedIncrement64((volatile LONG64 *) &pages_consumed);
+    check_watermarks();
     return free_page;
 }
 
+// This is how we get pages for new virtual addresses as well as old ones only exist on the paging file
+// While faults are queued for pages, a new fault is not allowed to take one ahead of them, or it could starve them
+// It gets NULL instead and joins the back of the queue, where it is handed a page in the order it arrived
+PPFN get_free_page(VOID) {
+    if (num_page_waiters != 0) {
+        return NULL;
+    }
+
+    return take_free_page();
+}
+
+// Hands pages to the faults waiting for them, oldest first, for as long as there are pages to take
+// Anything that puts pages on the free or standby lists calls this, without waiters it costs one read
+// The waiters lock comes after PTE locks and before PFN locks, so this must not be called holding a PFN or list lock
+VOID hand_pages_to_waiters(VOID)
+{
+    if (num_page_waiters == 0) {
+        return;
+    }
+
+    EnterCriticalSection(&page_waiters_lock);
+
+    while (page_waiters.Flink != &page_waiters)
+    {
+        PPFN pfn = take_free_page();
+        if (pfn == NULL) {
+            break;
+        }
+
+        // The page is off every list and no PTE points to it anymore, so no one else can find it while it is unlocked
+        unlock_pfn(pfn);
+
+        PPAGE_WAITER waiter = CONTAINING_RECORD(page_waiters.Flink, PAGE_WAITER, entry);
+        page_waiters.Flink = waiter->entry.Flink;
+        page_waiters.Flink->Blink = &page_waiters;
+        InterlockedDecrement64(&num_page_waiters);
+
+        // The waiter can return as soon as it sees the page, a wake on its address after that is harmless
+        InterlockedExchangePointer(&waiter->pfn, pfn);
+        WakeByAddressAll((PVOID) &waiter->pfn);
+    }
+
+    LeaveCriticalSection(&page_waiters_lock);
+}
+
+// Gives a page a fault was handed but no longer needs back to the free list, for the next waiter to take
+// The page is either from the free list or a zeroed standby page, so it is fit for the free list either way
+// It was counted as consumed when it was taken, the fault that takes it next counts it instead
+VOID release_unused_page(PPFN pfn)
+{
+    PFN pfn_contents = read_pfn(pfn);
+
+    InterlockedDecrement64((volatile LONG64 *) &pages_consumed);
+
+    pfn_contents.pte = NULL;
+    pfn_contents.disc_index = NO_DISC_INDEX;
+    pfn_contents.flags.state = FREE;
+    write_pfn(pfn, pfn_contents);
+
+    EnterCriticalSection(&free_page_list.lock);
+    add_to_list_head(pfn, &free_page_list);
+    LeaveCriticalSection(&free_page_list.lock);
+
+    unlock_pfn(pfn);
+}
+
+// Called with the PTE locked when there was no page to take. The fault first trims a few old pages itself,
+// So it does not depend entirely on the trimmer and the writers keeping up. Then it joins the back of the queue
+// And sleeps until a page is handed to it, and then carries on with that page instead of faulting again
+// The PTE is unlocked while we reclaim and wait, as reclaiming and the trimmer both need PTE regions
+// Returns the page locked along with the PTE, or NULL with the PTE unlocked if another fault resolved it meanwhile
+PPFN wait_for_page(PPTE pte, PTE pte_contents, PFAULT_STATS stats)
+{
+    PAGE_WAITER waiter;
+    PPFN pfn = NULL;
+    ULONG64 start_time = get_time_ns();
+
+    waiter.pfn = NULL;
+
+    unlock_pte(pte);
+
+    // Clean pages trimmed here are handed to the faults already waiting first, ours gets what is left once it is queued
+    direct_reclaim(pte);
+
+    EnterCriticalSection(&page_waiters_lock);
+    insert_tail_list(&page_waiters, &waiter.entry);
+    InterlockedIncrement64(&num_page_waiters);
+    LeaveCriticalSection(&page_waiters_lock);
+
+    // A page could have come free between our failed attempt and us joining the queue
+    hand_pages_to_waiters();
+
+    while ((pfn = (PPFN) waiter.pfn) == NULL)
+    {
+        WaitOnAddress(&waiter.pfn, &pfn, sizeof(PVOID), INFINITE);
+    }
+
+    record_fault_latency(stats, PAGE_WAIT, start_time);
+
+    lock_pte(pte);
+    lock_pfn(pfn);
+
+    if (read_pte(pte).entire_format != pte_contents.entire_format)
+    {
+        release_unused_page(pfn);
+        unlock_pte(pte);
+        hand_pages_to_waiters();
+        return NULL;
+    }
+
+    return pfn;
+}
+
 // This reads a page from the paging file and writes it back to memory
-PPFN read_page_on_disc(PPTE pte, PPFN free_page)
+PPFN read_page_on_disc(ULONG64 disc_index, PPFN free_page)
 {
     // We don't need a pfn lock here because this page is not on a list
-    // And therefore is not visible to any other threads
+    // And any other fault that finds it through its PTE waits for the read to finish
     ULONG_PTR frame_number = frame_number_from_pfn(free_page);
 
-    EnterCriticalSection(&modified_read_va_lock);
+    // Each fault borrows its own window, so hard faults on different threads read from the disc at the same time
+    PPAGE_WINDOW window = take_page_window();
 
     // We map these pages into our own va space to write contents into them, and then put them back in user va space
-    map_pages(modified_read_va, 1, &frame_number);
+    map_pages(window->va, 1, &frame_number);
 
     // This would be a disc driver that does this read and write in a real operating system
-    //PVOID source = (PVOID) ((ULONG_PTR) page_file + (pte->disc_format.disc_index * PAGE_SIZE));
-    //memcpy(modified_read_va, source, PAGE_SIZE);
-    read_from_pagefile(pte->disc_format.disc_index, modified_read_va);
+    //PVOID source = (PVOID) ((ULONG_PTR) page_file + (disc_index * PAGE_SIZE));
+    //memcpy(window->va, source, PAGE_SIZE);
+#if COMPRESSED_CACHE
+    BOOLEAN hard_fault = !IS_COMPRESSED_INDEX(disc_index);
+    if (hard_fault == FALSE) {
+        load_compressed_page(disc_index, window->va);
+    } else {
+        read_from_pagefile(disc_index, window->va);
+    }
+#else
+    BOOLEAN hard_fault = TRUE;
+    read_from_pagefile(disc_index, window->va);
+#endif
 
-    unmap_pages(modified_read_va, 1);
+    unmap_pages(window->va, 1);
 
-    LeaveCriticalSection(&modified_read_va_lock);
+    release_page_window(window);
 
-    // Set the bit at disc_index in disc in use to be 0 to reuse the disc spot
-    free_disc_index(pte->disc_format.disc_index);
+    // The paging file copy is kept for as long as the page stays clean, so trimming it again needs no write
+    // Compressed copies are given back right away, keeping them would hold the cache's memory for resident pages
+    if (hard_fault == FALSE) {
+        free_disc_index(disc_index);
+    }
     return free_page;
 }
 
+// Reads a page in from the paging file with its PTE region unlocked, so the rest of the region is not held up by the disc
+// Until the read is done the PTE points at the new page in transition format and the page's PFN says it is being read
+// Nothing else changes a PTE in that state, so once we lock it again it has to be exactly as we left it
+// Returns with the PTE and PFN locked again, the same as it was called
+VOID read_page_unlocked(PPTE pte, PPFN pfn, ULONG64 disc_index, PFAULT_STATS stats)
+{
+    PTE pte_contents;
+    PFN pfn_contents = read_pfn(pfn);
+
+    pfn_contents.pte = pte;
+    pfn_contents.disc_index = disc_index;
+    pfn_contents.flags.state = READ_IN_PROGRESS;
+    write_pfn(pfn, pfn_contents);
+
+    pte_contents.entire_format = 0;
+    pte_contents.transition_format.frame_number = frame_number_from_pfn(pfn);
+    write_pte(pte, pte_contents);
+
+    unlock_pfn(pfn);
+    unlock_pte(pte);
+
+    // Only reads from the page file come through here, the compressed cache is read with the region still locked
+    ULONG64 start_time = get_time_ns();
+    read_page_on_disc(disc_index, pfn);
+    record_fault_latency(stats, HARD_FAULT_READ, start_time);
+
+    lock_pte(pte);
+    lock_pfn(pfn);
+
+    if (read_pte(pte).entire_format != pte_contents.entire_format || pfn->flags.state != READ_IN_PROGRESS) {
+        fatal_error("read_page_unlocked : the PTE changed while its page was being read");
+    }
+}
+
 // This is where we handle any access or fault of a page
-VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
+VOID page_fault_handler(PVOID arbitrary_va, ULONG access_type, PFAULT_STATS stats)
 {
     PPTE pte;
     PTE pte_contents;
     PPFN pfn;
     PFN pfn_contents;
     ULONG64 frame_number;
+    ULONG64 disc_index = NO_DISC_INDEX;
+    BOOLEAN read_unlocked = FALSE;
+    ULONG fault_type;
+    ULONG64 start_time = get_time_ns();
 
     // Pages go through the handler regardless of whether they have faulted or not
     // This is because even if a page is accessed without a fault, it's age in the pte must be updated
@@ -161,17 +399,44 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     if (pte_contents.memory_format.valid == 1)
     {
         stats->num_fake_faults++;
+        BOOLEAN first_write = access_type == WRITE_ACCESS && pte_contents.memory_format.dirty == 0;
+
         // We do this check to avoid a pte write
-        if (pte_contents.memory_format.age == 0)
+        if (pte_contents.memory_format.age == 0 && first_write == FALSE)
         {
             unlock_pte(pte);
+            record_fault_latency(stats, FAKE_FAULT, start_time);
             return;
         }
 
+        // The first write to a clean page makes its paging file copy stale, so the copy is given back here
+        if (first_write)
+        {
+            pfn = pfn_from_frame_number(pte_contents.memory_format.frame_number);
+            lock_pfn(pfn);
+            disc_index = pfn->disc_index;
+            pfn->disc_index = NO_DISC_INDEX;
+            unlock_pfn(pfn);
+
+            pte_contents.memory_format.dirty = 1;
+        }
+
         pte_contents.memory_format.age = 0;
         write_pte(pte, pte_contents);
 
         unlock_pte(pte);
+
+        if (disc_index != NO_DISC_INDEX) {
+            free_disc_index(disc_index);
+        }
+
+        // Time spent being paced is left out, it is the cost of dirtying pages and not of the fault
+        record_fault_latency(stats, FAKE_FAULT, start_time);
+
+        // A thread making pages dirty faster than the writers can clean them is paced here, without any locks held
+        if (first_write) {
+            note_page_dirtied();
+        }
         return;
     }
 
@@ -184,16 +449,32 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     // We know now that we need to get a free/standby page and map it to this va
     if (pte_contents.entire_format == 0)
     {
+        fault_type = DEMAND_ZERO_FAULT;
+
+        // Only a committed page has anything behind it, touching any other is an access violation
+        if (is_committed(arbitrary_va) == FALSE) {
+            unlock_pte(pte);
+            fatal_error("page_fault_handler : accessed a virtual address that is not committed");
+        }
+
         // Get_free_page now returns a locked page, so we do not need to do it here
         pfn = get_free_page();
 
         // This occurs when we get_free_page fails to find us a free page
-        // When this happens, we release our lock on this pte and wait for pages to become available
-        // Once we are able to map a page to this va, we return, which lets the thread fault on this va again
+        // When this happens, we wait in line for a page to be handed to us and carry on with it
         if (pfn == NULL) {
-            unlock_pte(pte);
-            WaitForSingleObject(pages_available_event, INFINITE);
-            return;
+            pfn = wait_for_page(pte, pte_contents, stats);
+            if (pfn == NULL) {
+                return;
+            }
+
+            // The page could have been decommitted while we waited without the PTE lock
+            if (is_committed(arbitrary_va) == FALSE) {
+                release_unused_page(pfn);
+                unlock_pte(pte);
+                hand_pages_to_waiters();
+                return;
+            }
         }
     }
     // At this point, we know that this pte is in transition or disc format, as the valid bit is clear
@@ -204,15 +485,27 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     // We want to minimize hard faults, as they takes exponentially longer than other types of faults to resolve
     else if (pte_contents.disc_format.on_disc == 1) {
 
+        fault_type = HARD_FAULT;
         pfn = get_free_page();
         if (pfn == NULL) {
-            unlock_pte(pte);
-            WaitForSingleObject(pages_available_event, INFINITE);
-            return;
+            pfn = wait_for_page(pte, pte_contents, stats);
+            if (pfn == NULL) {
+                return;
+            }
         }
 
         // This is where we actually read the page from the disc and write its contents to our new page
-        read_page_on_disc(pte, pfn);
+        // The compressed cache is in memory, so a page coming from there is read with the region still locked
+#if COMPRESSED_CACHE
+        if (IS_COMPRESSED_INDEX(pte_contents.disc_format.disc_index)) {
+            read_page_on_disc(pte_contents.disc_format.disc_index, pfn);
+        } else
+#endif
+        {
+            disc_index = pte_contents.disc_format.disc_index;
+            read_page_unlocked(pte, pfn, disc_index, stats);
+            read_unlocked = TRUE;
+        }
 
         // At this point, we know that our pte is in transition format, as it is not active or on disc
         // This va must have been trimmed, but its pfn has not been repurposed
@@ -222,16 +515,18 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     } else {
         // This will unlink our page from the standby or modified list
         // It uses the PFNs information to determine which list it is on
+        fault_type = SOFT_FAULT;
 
         pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
 
         // Because we need to acquire a pfn before a PTE inside our get_free_page function,
         // We can no longer trust a transition format PTE's contents until we also lock its pfn
         // After locking the pfn we need to reread the pte and ensure that it did not become disc format
+        // The modified writer can also turn it back into a demand zero PTE if the page was all zeroes
+        // So any change at all means this page is no longer ours and we fault again
         lock_pfn(pfn);
 
-        pte_contents = read_pte(pte);
-        if (pte_contents.disc_format.on_disc == 1)
+        if (read_pte(pte).entire_format != pte_contents.entire_format)
         {
             unlock_pfn(pfn);
             unlock_pte(pte);
@@ -241,23 +536,54 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
         // assert(pte_contents.transition_format.always_zero == 0)
         // assert(pte_contents.transition_format.always_zero2 == 0)
         // assert(pte_contents.transition_format.frame_number == frame_number_from_pfn(pfn))
-        // assert(pfn->flags.state == STANDBY || pfn->flags.state == MODIFIED)
+        // assert(pfn->flags.state == STANDBY || pfn->flags.state == MODIFIED || pfn->flags.state == READ_IN_PROGRESS)
+
+        // Another fault is reading this page in, so we wait for it to finish and fault again instead of reading it twice
+        // The wait returns as soon as the flags differ from what we saw here, even if they changed before we got to it
+        if (pfn->flags.state == READ_IN_PROGRESS) {
+            PFN_FLAGS flags = pfn->flags;
+            unlock_pfn(pfn);
+            unlock_pte(pte);
+
+            InterlockedIncrement64((volatile LONG64 *) &read_collisions);
+            WaitOnAddress(&pfn->flags, &flags, sizeof(PFN_FLAGS), INFINITE);
+            return;
+        }
 
         if (pfn->flags.state == MODIFIED) {
-            EnterCriticalSection(&modified_page_list.lock);
-            remove_from_list(pfn);
-            LeaveCriticalSection(&modified_page_list.lock);
+            // A referenced page has been taken off the modified list by the modified writer
+            // It is not on any list we can unlink it from, the writer sees it became active and drops its copy
+            if (pfn->flags.reference == 0) {
+                EnterCriticalSection(&modified_page_list.lock);
+                remove_from_list(pfn);
+                LeaveCriticalSection(&modified_page_list.lock);
+            }
 
         } else /*(pfn->flags.state == STANDBY) */{
 
             EnterCriticalSection(&standby_page_list.lock);
             remove_from_list(pfn);
-            // Freeing the space here and updating the pfn lower down
-            free_disc_index(pfn->disc_index);
             LeaveCriticalSection(&standby_page_list.lock);
+
+            // The page keeps its copy while it is clean, compressed copies are freed the same as on a hard fault
+            disc_index = pfn->disc_index;
+#if COMPRESSED_CACHE
+            if (IS_COMPRESSED_INDEX(disc_index))
+            {
+                free_disc_index(disc_index);
+                disc_index = NO_DISC_INDEX;
+            }
+#endif
         }
     }
 
+    // A page that is faulted in to be written to will not match its copy, so there is no reason to keep it
+    if (access_type == WRITE_ACCESS && disc_index != NO_DISC_INDEX)
+    {
+        free_disc_index(disc_index);
+        disc_index = NO_DISC_INDEX;
+    }
+
     // We now have the page we need, we just need to correctly map it now to the pte and return
     pte_contents = read_pte(pte);
     pfn_contents = read_pfn(pfn);
@@ -266,11 +592,12 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     pte_contents.memory_format.frame_number = frame_number_from_pfn(pfn);
     pte_contents.memory_format.valid = 1;
     pte_contents.memory_format.age = 0;
+    pte_contents.memory_format.dirty = access_type == WRITE_ACCESS;
     write_pte(pte, pte_contents);
 
     pfn_contents.pte = pte;
     pfn_contents.flags.state = ACTIVE;
-    pfn_contents.disc_index = 0;
+    pfn_contents.disc_index = disc_index;
 
     if (pfn->flags.state == MODIFIED) {
         pfn_contents.flags.modified = 1;
@@ -279,6 +606,11 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
     }
     write_pfn(pfn, pfn_contents);
 
+    // Any faults that found this page being read in are waiting on its flags to change
+    if (read_unlocked) {
+        WakeByAddressAll(&pfn->flags);
+    }
+
     // This is a Windows API call that confirms the changes we made with the OS
     // We have already mapped this va to this page on our side, but the OS also needs to do the same on its side
     // This is necessary as this is a user mode program
@@ -286,22 +618,183 @@ VOID page_fault_handler(PVOID arbitrary_va, PFAULT_STATS stats)
 
     unlock_pfn(pfn);
     unlock_pte(pte);
+
+    record_fault_latency(stats, fault_type, start_time);
+
+    if (access_type == WRITE_ACCESS) {
+        note_page_dirtied();
+    }
 }
 
-// Eventually, we will move this to an api.c and api.h file
-// That way programs can use our memory manager without knowing or having to know anything about how it works
-PVOID allocate_memory(PULONG_PTR num_bytes)
+// Reads the pages of a prefault that are on the paging file, pages on consecutive slots are read with one copy or I/O
+// The pages are on no list and their PTEs stay locked, so nothing else can reach them while they are read
+VOID read_prefault_pages(PULONG_PTR frame_numbers, PULONG64 disc_indices, ULONG64 num_pages)
 {
-    *num_bytes = virtual_address_size;
-    return va_base;
+    ULONG64 first = 0;
+    PVOID window = get_region_window();
+
+    map_pages(window, num_pages, frame_numbers);
+
+    for (ULONG64 i = 1; i <= num_pages; i++)
+    {
+        if (i == num_pages || disc_indices[i] != disc_indices[i - 1] + 1)
+        {
+            read_pages_from_pagefile(disc_indices[first], (PVOID) ((ULONG_PTR) window + first * PAGE_SIZE), i - first);
+            first = i;
+        }
+    }
+
+    unmap_pages(window, num_pages);
+}
+
+// Resolves num_ptes PTEs that are all in one region, taking the region lock once for all of them
+// New pages and pages on the paging file are the only ones taken, resident and transition pages are cheap to fault on
+// Returns how many pages were made valid
+ULONG64 prefault_region(PPTE first_pte, ULONG64 num_ptes, ULONG access_type)
+{
+    PPTE ptes[PTE_REGION_SIZE];
+    PPFN pfns[PTE_REGION_SIZE];
+    ULONG64 disc_indices[PTE_REGION_SIZE];
+    PVOID user_vas[PTE_REGION_SIZE];
+    ULONG_PTR frame_numbers[PTE_REGION_SIZE];
+    ULONG_PTR read_frame_numbers[PTE_REGION_SIZE];
+    ULONG64 read_disc_indices[PTE_REGION_SIZE];
+    ULONG64 num_pages = 0;
+    ULONG64 num_reads = 0;
+
+    lock_pte(first_pte);
+
+    for (ULONG64 i = 0; i < num_ptes; i++)
+    {
+        PPTE pte = first_pte + i;
+        PTE pte_contents = read_pte(pte);
+
+        if (pte_contents.entire_format != 0 &&
+            (pte_contents.memory_format.valid == 1 || pte_contents.disc_format.on_disc == 0)) {
+            continue;
+        }
+        // Pages that were never committed are left for their access to fail on
+        if (pte_contents.entire_format == 0 && is_committed(va_from_pte(pte)) == FALSE) {
+            continue;
+        }
+
+        // A prefault is only a hint, so it never waits for pages or takes them from faults that are already waiting
+        // Get_free_page gives us nothing while any are, and whatever is left over is faulted in as usual
+        PPFN pfn = get_free_page();
+        if (pfn == NULL) {
+            break;
+        }
+
+        ptes[num_pages] = pte;
+        pfns[num_pages] = pfn;
+        disc_indices[num_pages] = NO_DISC_INDEX;
+
+        if (pte_contents.entire_format != 0)
+        {
+            ULONG64 disc_index = pte_contents.disc_format.disc_index;
+#if COMPRESSED_CACHE
+            // The compressed cache is in memory, there is nothing to batch and its copy is given back as it is loaded
+            if (IS_COMPRESSED_INDEX(disc_index)) {
+                read_page_on_disc(disc_index, pfn);
+            } else
+#endif
+            {
+                read_frame_numbers[num_reads] = frame_number_from_pfn(pfn);
+                read_disc_indices[num_reads] = disc_index;
+                num_reads++;
+                disc_indices[num_pages] = disc_index;
+            }
+        }
+        num_pages++;
+    }
+
+    if (num_reads != 0) {
+        read_prefault_pages(read_frame_numbers, read_disc_indices, num_reads);
+    }
+
+    for (ULONG64 i = 0; i < num_pages; i++)
+    {
+        PTE pte_contents;
+        PFN pfn_contents = read_pfn(pfns[i]);
+
+        // The same as a fault, a page that is about to be written to will not match its copy
+        if (access_type == WRITE_ACCESS && disc_indices[i] != NO_DISC_INDEX)
+        {
+            free_disc_index(disc_indices[i]);
+            disc_indices[i] = NO_DISC_INDEX;
+        }
+
+        frame_numbers[i] = frame_number_from_pfn(pfns[i]);
+        user_vas[i] = va_from_pte(ptes[i]);
+
+        pte_contents.entire_format = 0;
+        pte_contents.memory_format.frame_number = frame_numbers[i];
+        pte_contents.memory_format.valid = 1;
+        pte_contents.memory_format.dirty = access_type == WRITE_ACCESS;
+        write_pte(ptes[i], pte_contents);
+
+        pfn_contents.pte = ptes[i];
+        pfn_contents.flags.state = ACTIVE;
+        pfn_contents.flags.modified = 0;
+        pfn_contents.disc_index = disc_indices[i];
+        write_pfn(pfns[i], pfn_contents);
+    }
+
+    if (num_pages != 0) {
+        map_pages_scatter(user_vas, num_pages, frame_numbers);
+    }
+
+    for (ULONG64 i = 0; i < num_pages; i++)
+    {
+        unlock_pfn(pfns[i]);
+    }
+    unlock_pte(first_pte);
+
+    if (access_type == WRITE_ACCESS)
+    {
+        for (ULONG64 i = 0; i < num_pages; i++)
+        {
+            note_page_dirtied();
+        }
+    }
+
+    return num_pages;
+}
+
+// Resolves every page in a range ahead of the accesses to it, for callers that know they are about to touch all of it
+// The range is walked a region at a time, each region's pages are taken together, whatever it has on the paging file
+// Is read in one batch, and all of its pages are mapped with one scatter call instead of one fault and one map per page
+// Access_type hints at what the caller will do, pages prefaulted for writing are made dirty right away
+// Returns how many pages were made valid, any that were not are simply faulted in when they are accessed
+ULONG64 prefault_range(PVOID virtual_address, ULONG64 num_bytes, ULONG access_type)
+{
+    PPTE pte;
+    PPTE last_pte;
+    ULONG64 num_prefaulted = 0;
+
+    if (num_bytes == 0) {
+        return 0;
+    }
+
+    pte = pte_from_va(virtual_address);
+    last_pte = pte_from_va((PVOID) ((ULONG_PTR) virtual_address + num_bytes - 1));
+
+    while (pte <= last_pte)
+    {
+        PPTE region_end = pte_base + ((pte - pte_base) / PTE_REGION_SIZE + 1) * PTE_REGION_SIZE;
+        ULONG64 num_ptes = min(region_end, last_pte + 1) - pte;
+
+        num_prefaulted += prefault_region(pte, num_ptes, access_type);
+        pte += num_ptes;
+    }
+
+    InterlockedAdd64((volatile LONG64 *) &prefaulted_pages, (LONG64) num_prefaulted);
+    return num_prefaulted;
 }
 
 // This main is likely to be moved to userapp.c in the future
-// Figure out attribute unused
 int main (int argc, char** argv)
 {
-    UNREFERENCED_PARAMETER(argc);
-    UNREFERENCED_PARAMETER(argv);
      /* This is where we initialize and test our virtual memory management state machine
 
      We control the entirety of virtual and physical memory management with only two exceptions
@@ -318,8 +811,14 @@ int main (int argc, char** argv)
      Virtual memory operations like handling page faults, materializing mappings, freeing them, trimming them,
      Writing them out to a paging file, bringing them back from the paging file, protecting them, and much more */
 
+    parse_arguments(argc, argv);
+
     initialize_system();
 
+#if RUN_BENCHMARKS
+    run_benchmarks();
+#endif
+
     run_system();
 
     //print_va_access_rate();